@@ -0,0 +1,74 @@
+#!/bin/sh
+# Fill a directory with synthetic run-parts entries.
+#
+# Usage: bench/mkparts.sh DIR COUNT [KIND [BYTES]]
+#
+# KIND is one of
+#   mixed    valid and invalid names, non-executable files, symlinks and
+#            directories besides trivial scripts, as a real hook
+#            directory collects over time (the default)
+#   trivial  only scripts that do nothing
+#   output   only scripts that each write BYTES bytes (default 1 MiB) to
+#            standard output
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 DIR COUNT [KIND [BYTES]]" >&2
+    exit 1
+fi
+
+dir=$1
+count=$2
+kind=${3:-mixed}
+bytes=${4:-1048576}
+
+mkdir -p "$dir"
+
+trivial() {
+    printf '#!/bin/sh\nexit 0\n' > "$1"
+    chmod 755 "$1"
+}
+
+output() {
+    printf '#!/bin/sh\nhead -c %d /dev/zero\n' "$bytes" > "$1"
+    chmod 755 "$1"
+}
+
+i=0
+while [ $i -lt "$count" ]; do
+    name=$(printf '%05d-part' $i)
+    case $kind in
+    trivial)
+	trivial "$dir/$name"
+	;;
+    output)
+	output "$dir/$name"
+	;;
+    mixed)
+	case $((i % 20)) in
+	0|1)	# Names run-parts skips
+	    trivial "$dir/$name.dpkg-old" ;;
+	2)
+	    trivial "$dir/$name~" ;;
+	3)
+	    trivial "$dir/$name.sh" ;;
+	4|5)	# Not executable
+	    printf '#!/bin/sh\nexit 0\n' > "$dir/$name" ;;
+	6)
+	    ln -sf "$(printf '%05d-part' $((i + 4)))" "$dir/$name" ;;
+	7)	# Dangling
+	    ln -sf missing "$dir/$name" ;;
+	8)
+	    mkdir -p "$dir/$name" ;;
+	*)
+	    trivial "$dir/$name" ;;
+	esac
+	;;
+    *)
+	echo "$0: unknown kind $kind" >&2
+	exit 1
+	;;
+    esac
+    i=$((i + 1))
+done
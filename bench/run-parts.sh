@@ -0,0 +1,65 @@
+#!/bin/sh
+# Benchmark run-parts and print the results as one JSON object, for
+# comparing builds.
+#
+# Usage: bench/run-parts.sh [RUN-PARTS]
+#
+# The sizes can be changed through the environment:
+#   BENCH_ENTRIES  entries in the directory that is scanned (20000)
+#   BENCH_PARTS    trivial scripts run for the spawn rate (500)
+#   BENCH_OUTPUT   bytes written by the --report script (64 MiB)
+#   BENCH_ROUNDS   runs of each benchmark, of which the best counts (5)
+
+set -e
+
+runparts=${1:-./run-parts}
+bench=$(dirname "$0")
+entries=${BENCH_ENTRIES:-20000}
+parts=${BENCH_PARTS:-500}
+output=${BENCH_OUTPUT:-67108864}
+rounds=${BENCH_ROUNDS:-5}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+sh "$bench/mkparts.sh" "$dir/mixed" "$entries" mixed
+sh "$bench/mkparts.sh" "$dir/trivial" "$parts" trivial
+sh "$bench/mkparts.sh" "$dir/output" 1 output "$output"
+
+# Best wall clock time of the command, in microseconds
+best() {
+    min=
+    r=0
+    while [ $r -lt "$rounds" ]; do
+	start=$(date +%s%N)
+	"$@" </dev/null >/dev/null 2>&1 || true
+	end=$(date +%s%N)
+	t=$(( (end - start) / 1000 ))
+	if [ -z "$min" ] || [ $t -lt $min ]; then
+	    min=$t
+	fi
+	r=$((r + 1))
+    done
+    echo $min
+}
+
+# Work per second, given a count and a time in microseconds
+rate() {
+    echo $(( $1 * 1000000 / ($2 > 0 ? $2 : 1) ))
+}
+
+listed=$("$runparts" --list "$dir/mixed" 2>/dev/null | wc -l)
+scan_us=$(best "$runparts" --test "$dir/mixed")
+list_us=$(best "$runparts" --list "$dir/mixed")
+spawn_us=$(best "$runparts" "$dir/trivial")
+report_us=$(best "$runparts" --report "$dir/output")
+
+printf '{"benchmark":"run-parts","version":"%s",' \
+    "$("$runparts" --version 2>&1 | sed -n '1s/.*version //p')"
+printf '"entries":%d,"scan_us":%d,' "$entries" "$scan_us"
+printf '"listed":%d,"list_us":%d,"list_per_sec":%d,' \
+    "$listed" "$list_us" "$(rate "$listed" "$list_us")"
+printf '"parts":%d,"spawn_us":%d,"spawn_per_sec":%d,' \
+    "$parts" "$spawn_us" "$(rate "$parts" "$spawn_us")"
+printf '"report_bytes":%d,"report_us":%d,"report_bytes_per_sec":%d}\n' \
+    "$output" "$report_us" "$(rate "$output" "$report_us")"
@@ -0,0 +1,88 @@
+#!/bin/sh
+# Check that run-parts and tempfile stay within their system call
+# budgets.
+#
+# Usage: bench/syscalls.sh SYSCOUNT RUN-PARTS TEMPFILE BUDGETS
+#
+# For run-parts the cost of one more directory entry is measured, by
+# comparing a small and a large directory, so that start-up costs do
+# not count.  For tempfile it is the whole cost of creating one file,
+# and for tempfile --count the cost of one more file in the batch.
+# Results are printed as JSON, one object per check, and the exit
+# status is 1 if any check is over the budget given for it in BUDGETS.
+
+set -e
+
+if [ $# -ne 4 ]; then
+    echo "Usage: $0 SYSCOUNT RUN-PARTS TEMPFILE BUDGETS" >&2
+    exit 2
+fi
+
+syscount=$1
+runparts=$2
+tempfile=$3
+budgets=$4
+bench=$(dirname "$0")
+
+small=200
+large=1200
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for n in $small $large; do
+    sh "$bench/mkparts.sh" "$dir/mixed$n" $n mixed
+    sh "$bench/mkparts.sh" "$dir/trivial$n" $((n / 10)) trivial
+done
+
+# System calls made by a command
+count() {
+    "$syscount" -o "$dir/count" "$@" </dev/null >/dev/null 2>&1 || true
+    cat "$dir/count"
+}
+
+failed=0
+
+# check NAME COUNT PER: compare COUNT / PER against the budget for NAME
+check() {
+    budget=$(sed -n "s/^$1[ 	][ 	]*//p" "$budgets")
+    if [ -z "$budget" ]; then
+	echo "$0: no budget for $1 in $budgets" >&2
+	exit 2
+    fi
+    result=$(awk -v c="$2" -v n="$3" -v b="$budget" \
+	'BEGIN { printf "%.2f %d", c / n, (c / n > b) }')
+    printf '{"check":"%s","syscalls":%s,"budget":%s}\n' \
+	"$1" "${result% *}" "$budget"
+    if [ "${result#* }" = 1 ]; then
+	echo "$0: $1 makes ${result% *} system calls, budget $budget" >&2
+	failed=1
+    fi
+}
+
+# Per entry, from the difference between the small and large directory
+per_entry() {
+    name=$1
+    kind=$2
+    shift 2
+    c1=$(count "$runparts" "$@" "$dir/$kind$small")
+    c2=$(count "$runparts" "$@" "$dir/$kind$large")
+    if [ "$kind" = trivial ]; then
+	check "$name" $((c2 - c1)) $(( (large - small) / 10 ))
+    else
+	check "$name" $((c2 - c1)) $((large - small))
+    fi
+}
+
+per_entry list mixed --list
+per_entry test mixed --test
+per_entry run trivial
+per_entry report trivial --report
+
+mkdir "$dir/tmp"
+check tempfile "$(count "$tempfile" -d "$dir/tmp")" 1
+c1=$(count "$tempfile" -d "$dir/tmp" --count=$small)
+c2=$(count "$tempfile" -d "$dir/tmp" --count=$large)
+check count $((c2 - c1)) $((large - small))
+
+exit $failed
@@ -0,0 +1,155 @@
+/* syscount: count the system calls made by a program
+ *
+ * Usage: syscount [-v] [-o FILE] PROGRAM [ARGUMENT]...
+ *
+ * Runs PROGRAM under ptrace and prints the number of system calls it
+ * made, not counting those of its children, to FILE or standard error.
+ * With -v each system call number is listed with its count as well.
+ * The exit status is that of PROGRAM.
+ *
+ * This is free software; see the GNU General Public License version 2
+ * or later for copying conditions.  There is NO warranty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/uio.h>
+#include <elf.h>
+
+#define MAX_SYSCALLS 1024
+
+/* At a syscall stop, find out whether it is the entry to a system call
+   and which one.  PTRACE_GET_SYSCALL_INFO (Linux 5.3) says so directly;
+   older kernels only give the registers, and entry and exit stops are
+   told apart by counting them in *insyscall. */
+static int syscall_entry(pid_t pid, int *insyscall, long *nr)
+{
+  struct user_regs_struct regs;
+  struct iovec iov;
+#ifdef PTRACE_GET_SYSCALL_INFO
+  struct __ptrace_syscall_info info;
+
+  if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *)sizeof(info), &info) > 0) {
+    *nr = info.op == PTRACE_SYSCALL_INFO_ENTRY ? (long)info.entry.nr : -1;
+    return info.op == PTRACE_SYSCALL_INFO_ENTRY;
+  }
+#endif /* PTRACE_GET_SYSCALL_INFO */
+
+  *insyscall = !*insyscall;
+  if (!*insyscall)
+    return 0;
+  iov.iov_base = &regs;
+  iov.iov_len = sizeof(regs);
+  *nr = -1;
+  if (!ptrace(PTRACE_GETREGSET, pid, (void *)NT_PRSTATUS, &iov)) {
+#if defined(__x86_64__)
+    *nr = regs.orig_rax;
+#elif defined(__i386__)
+    *nr = regs.orig_eax;
+#elif defined(__aarch64__)
+    *nr = regs.regs[8];
+#endif
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long counts[MAX_SYSCALLS];
+  unsigned long total = 0;
+  siginfo_t si;
+  int verbose = 0, status, insyscall = 0, sig, i;
+  FILE *out = stderr;
+  long nr;
+  pid_t pid;
+
+  for (; argc > 1 && argv[1][0] == '-'; argv++, argc--) {
+    if (!strcmp(argv[1], "-v"))
+      verbose = 1;
+    else if (!strcmp(argv[1], "-o") && argc > 2) {
+      if (!(out = fopen(argv[2], "w"))) {
+	perror(argv[2]);
+	return 2;
+      }
+      argv++;
+      argc--;
+    }
+    else
+      break;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "Usage: syscount [-v] [-o FILE] PROGRAM [ARGUMENT]...\n");
+    return 2;
+  }
+  memset(counts, 0, sizeof(counts));
+
+  if ((pid = fork()) < 0) {
+    perror("syscount: fork");
+    return 2;
+  }
+  if (!pid) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    execvp(argv[1], argv + 1);
+    perror("syscount: exec");
+    _exit(127);
+  }
+
+  /* Count from the exec onwards; the stop before it is our own */
+  if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+    perror("syscount: waitpid");
+    return 2;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	 (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC));
+  sig = 0;
+  for (;;) {
+    if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) < 0) {
+      perror("syscount: ptrace");
+      return 2;
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("syscount: waitpid");
+      return 2;
+    }
+    sig = 0;
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+      break;
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      if (!syscall_entry(pid, &insyscall, &nr))
+	continue;
+      total++;
+      if (nr >= 0 && nr < MAX_SYSCALLS)
+	counts[nr]++;
+    }
+    else if (WSTOPSIG(status) == SIGTRAP && status >> 16 == PTRACE_EVENT_EXEC)
+      ;
+    /* A group-stop has no siginfo; the signal has been delivered
+       already and must not be injected again */
+    else if (ptrace(PTRACE_GETSIGINFO, pid, NULL, &si) < 0)
+      ;
+    else
+      sig = WSTOPSIG(status);
+  }
+
+  fprintf(out, "%lu\n", total);
+  if (verbose)
+    for (i = 0; i < MAX_SYSCALLS; i++)
+      if (counts[i])
+	fprintf(out, "%d %lu\n", i, counts[i]);
+  fclose(out);
+
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
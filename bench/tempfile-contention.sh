@@ -0,0 +1,43 @@
+#!/bin/sh
+# Time CREATORS concurrent tempfile processes each creating FILES files
+# with the same prefix in one directory, and count the failures.
+#
+# Usage: bench/tempfile-contention.sh [TEMPFILE [CREATORS [FILES]]]
+
+set -e
+
+tempfile=${1:-./tempfile}
+creators=${2:-${BENCH_CREATORS:-64}}
+files=${3:-${BENCH_FILES:-200}}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+creator() {
+    f=0
+    fail=0
+    while [ $f -lt "$files" ]; do
+	TMPDIR= "$tempfile" -d "$dir/tmp" -p bench >/dev/null 2>&1 ||
+	    fail=$((fail + 1))
+	f=$((f + 1))
+    done
+    echo $fail > "$dir/fail.$1"
+}
+
+mkdir "$dir/tmp"
+start=$(date +%s%N)
+c=0
+while [ $c -lt "$creators" ]; do
+    creator $c &
+    c=$((c + 1))
+done
+wait
+end=$(date +%s%N)
+
+failed=$(cat "$dir"/fail.* | awk '{ n += $1 } END { print n + 0 }')
+created=$(ls "$dir/tmp" | wc -l)
+ms=$(( (end - start) / 1000000 ))
+
+printf '{"benchmark":"tempfile-contention","creators":%d,"files":%d,' \
+    "$creators" "$files"
+printf '"created":%d,"failed":%d,"ms":%d}\n' "$created" "$failed" "$ms"
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Time tempfile creating files in a directory as it fills up, flat and
+# with --shard.  Each step creates FILES files in one tempfile --count
+# run and reports the cost per file at the population reached so far.
+#
+# Usage: bench/tempfile-shard.sh [TEMPFILE [POPULATION [FILES [SHARDS]]]]
+
+set -e
+
+tempfile=${1:-./tempfile}
+population=${2:-${BENCH_POPULATION:-200000}}
+files=${3:-${BENCH_FILES:-20000}}
+shards=${4:-${BENCH_SHARDS:-64}}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# layout NAME [OPTION]: fill $dir/NAME to POPULATION files
+layout() {
+    mkdir "$dir/$1"
+    n=0
+    while [ $n -lt "$population" ]; do
+	start=$(date +%s%N)
+	TMPDIR= "$tempfile" -d "$dir/$1" --count="$files" $2 >/dev/null
+	end=$(date +%s%N)
+	printf '{"benchmark":"tempfile-shard","layout":"%s",' "$1"
+	printf '"population":%d,"files":%d,"ns_per_file":%d}\n' \
+	    "$n" "$files" $(( (end - start) / files ))
+	n=$((n + files))
+    done
+}
+
+layout flat
+layout sharded --shard="$shards"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Time run-parts on a directory of trivial #!/bin/sh parts, with and
+# without --warm-shell.
+#
+# Usage: bench/warm-shell.sh [RUN-PARTS [PARTS [ROUNDS]]]
+
+set -e
+
+runparts=${1:-./run-parts}
+parts=${2:-${BENCH_PARTS:-500}}
+rounds=${3:-${BENCH_ROUNDS:-5}}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+i=0
+while [ $i -lt "$parts" ]; do
+    name=$(printf 'part%04d' $i)
+    printf '#!/bin/sh\n: "$@"\n' > "$dir/$name"
+    chmod +x "$dir/$name"
+    i=$((i + 1))
+done
+
+# Best wall clock time of ROUNDS runs, in milliseconds
+best() {
+    min=
+    r=0
+    while [ $r -lt "$rounds" ]; do
+	start=$(date +%s%N)
+	"$runparts" "$@" "$dir" </dev/null >/dev/null
+	end=$(date +%s%N)
+	t=$(( (end - start) / 1000000 ))
+	if [ -z "$min" ] || [ $t -lt $min ]; then
+	    min=$t
+	fi
+	r=$((r + 1))
+    done
+    echo $min
+}
+
+exec_ms=$(best)
+warm_ms=$(best --warm-shell)
+
+printf '{"benchmark":"warm-shell","parts":%d,"rounds":%d,' "$parts" "$rounds"
+printf '"exec_ms":%d,"warm_ms":%d}\n' "$exec_ms" "$warm_ms"
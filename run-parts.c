@@ -29,12 +29,299 @@
 #include <ctype.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 #include <regex.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif /* HAVE_SYS_SDT_H */
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#endif /* HAVE_LINUX_IO_URING_H */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define SHA256_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* USDT probes for perf, bpftrace or SystemTap; each is a single nop in
+   the code and a note in the binary, so they cost nothing until used. */
+#ifdef HAVE_SYS_SDT_H
+#define PROBE1(name, a) STAP_PROBE1(run_parts, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(run_parts, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(run_parts, name, a, b, c)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif /* HAVE_SYS_SDT_H */
 
 #define RUNPARTS_NORMAL 0
 #define RUNPARTS_ERE 1
 #define RUNPARTS_LSBSYSINIT 100
 
+/* Values returned by getopt_long() for long-only options with arguments */
+#define OPT_MAX_PRESSURE 256
+#define OPT_NICE 257
+#define OPT_IOPRIO 258
+#define OPT_SCHED 259
+#define OPT_CPU_AFFINITY 260
+#define OPT_OOM_SCORE_ADJ 261
+#define OPT_PART_CONFIG 262
+#define OPT_STATUS_FILE 263
+#define OPT_CONTROL_SOCKET 264
+#define OPT_TRACE 265
+#define OPT_REGEX 266
+#define OPT_INCLUDE_GLOB 267
+#define OPT_EXCLUDE_GLOB 268
+#define OPT_FROM_MANIFEST 269
+#define OPT_FORMAT 270
+#define OPT_VERIFY 271
+#define OPT_DIGEST_CACHE 272
+#define OPT_JOURNAL 273
+#define OPT_LOG_DIR 274
+#define OPT_LOG_KEEP 275
+
+/* Resources checked by --max-pressure */
+#define PRESSURE_CPU 0
+#define PRESSURE_MEMORY 1
+#define PRESSURE_IO 2
+#define PRESSURE_LOAD 3
+#define PRESSURE_RESOURCES 4
+
+/* Seconds between checks while a part is held back by --max-pressure */
+#define PRESSURE_POLL_INTERVAL 1
+
+/* ioprio_set(2) has no glibc wrapper or userspace header */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+/* Settings applied in the child before exec; LIMIT_UNSET leaves the
+   value inherited from run-parts alone. */
+#define LIMIT_UNSET INT_MIN
+
+struct part_limits {
+  int nice;
+  int ioprio;
+  int sched_policy;
+  int oom_score_adj;
+  int have_affinity;
+  cpu_set_t affinity;
+};
+
+/* Layout of the --status-file board.  A header is followed by one
+   status_part record per directory entry, in scan order.  Writers bump
+   seq to an odd value before and back to even after every update, so a
+   reader copies the data between two reads of an identical even seq.
+   Times are microseconds since the epoch; status is a waitpid() status. */
+#define STATUS_MAGIC 0x54535052 /* "RPST" */
+#define STATUS_VERSION 1
+#define STATUS_NAME_MAX 256
+
+#define PART_QUEUED 0
+#define PART_RUNNING 1
+#define PART_DONE 2
+#define PART_SKIPPED 3
+
+struct status_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t nparts;
+  int32_t pid;
+  int32_t current;
+  int64_t started;
+  int64_t finished;
+};
+
+struct status_part {
+  char name[STATUS_NAME_MAX];
+  int32_t state;
+  int32_t pid;
+  int32_t status;
+  int32_t reserved;
+  int64_t started;
+  int64_t finished;
+  uint64_t output_bytes;
+};
+
+#define SHA256_DIGEST_LENGTH 32
+
+/* A directory entry to be run, with the result of stat() on it and
+   what --from-manifest expects it to be */
+struct part {
+  char *path;
+  struct stat st;
+  int stat_errno;
+  int exec_fd;			/* the file a digest was checked on, or -1 */
+  int check_inode, check_mtime, check_digest;
+  ino_t inode;
+  struct timespec mtime;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+/* A --digest-cache record; a file is hashed again unless all of its
+   key matches */
+struct digest_entry {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime, ctime;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+/* A part allowed by --verify */
+struct verify_entry {
+  char *path;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+  size_t used;
+};
+
+/* Below this many entries, setting up an io_uring costs more than the
+   stat() calls it saves */
+#define URING_MIN_ENTRIES 16
+#define URING_MAX_BATCH 256
+
+/* Attributes printed by --format */
+#define FIELD_PATH 0
+#define FIELD_SIZE 1
+#define FIELD_MODE 2
+#define FIELD_UID 3
+#define FIELD_GID 4
+#define FIELD_MTIME 5
+#define FIELD_INODE 6
+#define FIELD_EXEC 7
+#define FIELD_INTERP 8
+#define FIELD_COUNT 9
+#define FORMAT_MAX_FIELDS 32
+
+/* --journal sends lines in batches of up to JOURNAL_BATCH datagrams
+   with sendmmsg(); longer lines are split, as journald would */
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+#define JOURNAL_LINE_MAX 49152
+#define JOURNAL_BATCH 32
+#define JOURNAL_BUFFER_SIZE (4 * JOURNAL_LINE_MAX)
+
+/* A queued journal entry and where its MESSAGE is, for writing it to
+   our own output if journald cannot be reached */
+struct journal_msg {
+  struct iovec iov;
+  int stream;
+  size_t message, length;
+};
+
+/* A part's output line being collected for the journal */
+struct journal_line {
+  char buf[JOURNAL_LINE_MAX];
+  size_t used;
+};
+
+/* The --warm-shell server.  It reads one request per line on fd 3,
+   "STDIN STDOUT STDERR PATH" with - for an inherited stream, runs the
+   script in a subshell and reports "pid N" once the subshell has set up
+   its streams and "status N" when it is done, on fd 4.  The subshell
+   finds its own pid in /proc/self/stat, since $$ is the server's, and
+   reports "nopid" instead of running the script if it cannot.  It
+   appends to its output streams so a shared log file is not truncated.
+   The server's own stderr, where the shell reports parts killed by a
+   signal, goes to /dev/null; parts get the original one from fd 5. */
+#define WARM_SHELL "/bin/sh"
+#define WARM_SHELL_SERVER \
+  "exec 5>&2 2>/dev/null\n" \
+  "while read -r rp_in rp_out rp_err rp_path <&3; do\n" \
+  "  (\n" \
+  "    read -r rp_pid rp_rest </proc/self/stat || { echo nopid >&4; exit; }\n" \
+  "    [ \"$rp_in\" = - ] || exec <\"$rp_in\"\n" \
+  "    [ \"$rp_out\" = - ] || exec >>\"$rp_out\"\n" \
+  "    if [ \"$rp_err\" = - ]; then exec 2>&5; else exec 2>>\"$rp_err\"; fi\n" \
+  "    echo \"pid $rp_pid\" >&4\n" \
+  "    exec 3<&- 4>&- 5>&-\n" \
+  "    unset rp_in rp_out rp_err rp_pid rp_rest\n" \
+  "    . \"$rp_path\"\n" \
+  "  )\n" \
+  "  echo \"status $?\" >&4\n" \
+  "done\n"
+
+/* Length of the longest parameter name warm_special_at() looks for */
+#define WARM_SPECIAL_MAX 6
+
+/* Output copied to a --log-dir file while it is also relayed is
+   written in chunks of this size */
+#define LOG_BUFFER_SIZE 65536
+
+/* Size of the --list and --test output buffer */
+#define LIST_BUFFER_SIZE 65536
+
+/* Filename patterns, compiled together into one lazily built DFA;
+   see matcher_add() */
+#define MATCHER_MAX_PATTERNS 32
+#define MATCHER_MAX_NODES 4096
+#define DFA_MAX_STATES 256
+
+struct nfa_node {
+  int kind;
+  int out, out1;
+  unsigned char set[32];
+};
+
+struct dfa_state {
+  int *nodes;
+  int count;
+  uint32_t hash;
+  uint32_t accept;
+  int next[256];
+};
+
+struct pattern {
+  regex_t re;
+  int use_regexec;
+};
+
+struct matcher {
+  struct pattern patterns[MATCHER_MAX_PATTERNS];
+  int npatterns;
+  struct nfa_node *nodes;
+  int nnodes, nalloc, start;
+  struct dfa_state *states;
+  int nstates, initial, flushes;
+  unsigned *mark, generation;
+  int *stack, *scratch, nscratch;
+};
+
+/* A --regex, --include-glob or --exclude-glob filter, globs already
+   translated to an ERE */
+struct name_filter {
+  char *ere;
+  int exclude;
+  int leading_dot;	/* does not match names starting with "." */
+};
+
+/* Per-part overrides read from --part-config */
+struct part_config {
+  char *name;
+  struct part_limits limits;
+  struct part_config *next;
+};
+
 int test_mode = 0;
 int list_mode = 0;
 int verbose_mode = 0;
@@ -44,12 +331,105 @@ int exitstatus = 0;
 int regex_mode = 0;
 int exit_on_error_mode = 0;
 int new_session_mode = 0;
+int pressure_mode = 0;
+
+static const char *pressure_names[PRESSURE_RESOURCES] = {
+  "cpu", "memory", "io", "load"
+};
+double pressure_limits[PRESSURE_RESOURCES] = { -1, -1, -1, -1 };
+
+struct part_limits default_limits = {
+  .nice = LIMIT_UNSET,
+  .ioprio = LIMIT_UNSET,
+  .sched_policy = LIMIT_UNSET,
+  .oom_score_adj = LIMIT_UNSET,
+  .have_affinity = 0
+};
+struct part_config *part_configs = NULL;
+
+char *status_path = NULL;
+struct status_header *status_board = NULL;
+struct status_part *status_parts = NULL;
+size_t status_size = 0;
+
+/* Connections to the --control-socket whose request line has not
+   fully arrived yet */
+#define CONTROL_CLIENTS 4
+struct control_client {
+  int fd;
+  size_t len;
+  char line[256];
+};
+
+char *control_path = NULL;
+int control_fd = -1;
+struct control_client control_clients[CONTROL_CLIENTS];
+pid_t control_owner = 0;
+int control_paused = 0;
+pid_t running_pid = 0;
+char *running_name = NULL;
+
+int stdin_fanout_mode = 0;
+int pipeline_mode = 0;
+int stdin_fd = -1;
+off_t stdin_offset = 0;
+
+char *journal_path = NULL;
+char *journal_dir = NULL;
+int journal_fd = -1;
+int journal_failed = 0;
+struct sockaddr_un journal_addr;
+char journal_buffer[JOURNAL_BUFFER_SIZE];
+size_t journal_used = 0;
+struct journal_msg journal_msgs[JOURNAL_BATCH];
+int journal_count = 0;
+struct journal_line journal_lines[2];
+
+int warm_mode = 0;
+pid_t warm_pid = 0;
+int warm_request = -1, warm_reply = -1;
+char warm_buf[256];
+size_t warm_used = 0;
+
+char *log_dir = NULL;
+int log_dir_fd = -1;
+int log_keep = 5;
+int log_fd = -1;
+char log_buffer[LOG_BUFFER_SIZE];
+size_t log_used = 0;
+
+char *trace_path = NULL;
+FILE *trace_file = NULL;
+int trace_events = 0;
+int trace_tid = 1, trace_lanes = 0;
 
 int argcount = 0, argsize = 0;
 char **args = 0;
 
-char *custom_ere;
-regex_t hierre, tradre, excsre, classicalre, customre;
+struct name_filter *filters = NULL;
+int filtercount = 0;
+char *manifest_path = NULL;
+
+char *verify_path = NULL;
+struct verify_entry *verify_entries = NULL;
+int verify_count = 0;
+
+char *digest_cache_path = NULL;
+struct digest_entry *digest_cache = NULL;
+int digest_cache_count = 0, digest_cache_sorted = 0, digest_cache_alloc = 0;
+int digest_cache_dirty = 0;
+
+static const char *field_names[FIELD_COUNT] = {
+  "path", "size", "mode", "uid", "gid", "mtime", "inode", "exec", "interp"
+};
+int format_fields[FORMAT_MAX_FIELDS];
+int format_count = 0;
+
+char list_buffer[LIST_BUFFER_SIZE];
+size_t list_used = 0;
+struct matcher name_matcher;
+uint32_t hierre, tradre, excsre, classicalre, include_mask, exclude_mask;
+uint32_t leading_dot_mask;
 
 static void catch_signals();
 static void restore_signals();
@@ -57,6 +437,10 @@ static void restore_signals();
 static char* regex_get_error(int errcode, regex_t *compiled);
 static void  regex_compile_pattern(void);
 static void  regex_clean(void);
+static uint32_t matcher_add(struct matcher *m, const char *pattern,
+			    int cflags);
+static uint32_t matcher_match(struct matcher *m, const char *name);
+static void matcher_free(struct matcher *m);
 
 void error(char *format, ...)
 {
@@ -98,6 +482,55 @@ void usage()
 	  "      --lsbsysinit    validate filenames based on LSB sysinit specs.\n"
 	  "      --new-session   run each script in a separate process session\n"
 	  "      --regex=PATTERN validate filenames based on POSIX ERE pattern PATTERN.\n"
+	  "      --include-glob=PATTERN\n"
+	  "                      validate filenames based on shell pattern PATTERN.\n"
+	  "      --exclude-glob=PATTERN\n"
+	  "                      ignore files whose names match shell pattern PATTERN.\n"
+	  "      --max-pressure=RESOURCE=LIMIT[,RESOURCE=LIMIT]...\n"
+	  "                      delay starting each script while the cpu, memory or\n"
+	  "                      io pressure (avg10 percent) or the load average is\n"
+	  "                      above LIMIT.\n"
+	  "      --nice=NICE     run scripts with niceness NICE.\n"
+	  "      --ioprio=CLASS[:LEVEL]\n"
+	  "                      run scripts in I/O scheduling class idle or\n"
+	  "                      best-effort.\n"
+	  "      --sched=POLICY  run scripts with scheduling policy idle, batch or\n"
+	  "                      other.\n"
+	  "      --cpu-affinity=CPULIST\n"
+	  "                      run scripts on the CPUs in CPULIST only.\n"
+	  "      --oom-score-adj=ADJ\n"
+	  "                      set the OOM killer score adjustment of scripts.\n"
+	  "      --part-config=FILE\n"
+	  "                      read per-script settings from FILE.\n"
+	  "      --status-file=FILE\n"
+	  "                      publish the progress of the run in FILE.\n"
+	  "      --control-socket=PATH\n"
+	  "                      accept list, cancel, pause and resume requests on\n"
+	  "                      the UNIX domain socket PATH.\n"
+	  "      --trace=FILE    write a Chrome trace event timeline of the run to\n"
+	  "                      FILE.\n"
+	  "      --from-manifest=FILE\n"
+	  "                      run the parts listed in FILE instead of scanning\n"
+	  "                      DIRECTORY.\n"
+	  "      --format=FIELD[,FIELD]...\n"
+	  "                      with --list or --test, print NUL terminated records\n"
+	  "                      of tab separated FIELDs: path, size, mode, uid, gid,\n"
+	  "                      mtime, inode, exec, interp.\n"
+	  "      --verify=FILE   only run scripts whose SHA-256 digest is listed in\n"
+	  "                      FILE, in sha256sum format.\n"
+	  "      --digest-cache=FILE\n"
+	  "                      remember the digests of unchanged scripts in FILE.\n"
+	  "      --stdin-fanout  read standard input once and give every script a copy\n"
+	  "                      of it.\n"
+	  "      --pipeline      run all scripts at once, connecting the output of each\n"
+	  "                      to the input of the next.\n"
+	  "      --journal[=SOCKET]\n"
+	  "                      send the output of scripts to the systemd journal\n"
+	  "                      line by line, instead of printing it.\n"
+	  "      --log-dir=DIR   write the output of each script to DIR/NAME.log.\n"
+	  "      --log-keep=K    keep the logs of the last K runs (default 5).\n"
+	  "      --warm-shell    run #!/bin/sh scripts in subshells of one long-running\n"
+	  "                      shell instead of executing them.\n"
 	  "  -u, --umask=UMASK   sets umask to UMASK (octal), default is 022.\n"
 	  "  -a, --arg=ARGUMENT  pass ARGUMENT to scripts, use once for each argument.\n"
 	  "  -V, --version       output version information and exit.\n"
@@ -122,325 +555,3299 @@ void set_umask()
   umask(mask);
 }
 
-/* Add an argument to the commands that we will call.  Called once for
-   every argument. */
-void add_argument(char *newarg)
+/* Parse the number of runs to keep for --log-keep */
+void set_log_keep(const char *value)
 {
-  if (argcount + 1 >= argsize) {
-    argsize = argsize ? argsize * 2 : 4;
-    args = realloc(args, argsize * (sizeof(char *)));
-    if (!args) {
-      error("failed to reallocate memory for arguments: %s", strerror(errno));
+  char *end;
+  long keep;
+
+  errno = 0;
+  keep = strtol(value, &end, 10);
+  if (errno || end == value || *end || keep < 1 || keep > 1000) {
+    error("bad log count `%s'", value);
+    exit(1);
+  }
+  log_keep = keep;
+}
+
+/* Parse a comma separated list of RESOURCE=LIMIT pairs for --max-pressure */
+void set_pressure_limits(char *spec)
+{
+  char *item, *value, *end;
+  int i;
+
+  for (item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+    if (!(value = strchr(item, '='))) {
+      error("bad pressure limit `%s'", item);
+      exit(1);
+    }
+    *value++ = '\0';
+    for (i = 0; i < PRESSURE_RESOURCES; i++)
+      if (!strcmp(item, pressure_names[i]))
+	break;
+    if (i == PRESSURE_RESOURCES) {
+      error("unknown pressure resource `%s'", item);
+      exit(1);
+    }
+    pressure_limits[i] = strtod(value, &end);
+    if (end == value || *end || pressure_limits[i] < 0) {
+      error("bad pressure limit `%s' for %s", value, item);
       exit(1);
     }
   }
-  args[argcount++] = newarg;
-  args[argcount] = 0;
+  pressure_mode = 1;
 }
 
-/* True or false? Is this a valid filename? */
-int valid_name(const struct dirent *d)
+/* Read the current value of a resource, or -1 if the kernel does not
+   report it (PSI needs Linux 4.20 and CONFIG_PSI). */
+static double read_pressure(int resource)
 {
-    char         *s;
-    unsigned int  retval;
+  char path[32], line[256], *p;
+  double value = -1;
+  FILE *f;
 
-    s = (char *)&(d->d_name);
+  if (resource == PRESSURE_LOAD)
+    return getloadavg(&value, 1) == 1 ? value : -1;
 
-    if (regex_mode == RUNPARTS_ERE)
-        retval = !regexec(&customre, s, 0, NULL, 0);
+  snprintf(path, sizeof(path), "/proc/pressure/%s", pressure_names[resource]);
+  if (!(f = fopen(path, "r")))
+    return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (!strncmp(line, "some ", 5) && (p = strstr(line, "avg10="))) {
+      value = strtod(p + 6, NULL);
+      break;
+    }
+  }
+  fclose(f);
+  return value;
+}
 
-    else if (regex_mode == RUNPARTS_LSBSYSINIT) {
+/* Monotonic time in microseconds, for --trace */
+static int64_t trace_clock(void)
+{
+  struct timespec ts;
 
-        if (!regexec(&hierre, s, 0, NULL, 0))
-            retval = regexec(&excsre, s, 0, NULL, 0);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	else
-            retval = !regexec(&tradre, s, 0, NULL, 0);
+/* Length of the well-formed UTF-8 sequence at s, or 0 if there is none */
+static int utf8_length(const unsigned char *s)
+{
+  unsigned char lo = 0x80, hi = 0xbf;
+  int len, i;
 
-    } else
-        retval = !regexec(&classicalre, s, 0, NULL, 0);
+  if (*s < 0xc2 || *s > 0xf4)
+    return 0;
+  len = *s < 0xe0 ? 2 : *s < 0xf0 ? 3 : 4;
+  /* Refuse overlong forms, surrogates and code points past U+10FFFF */
+  if (*s == 0xe0)
+    lo = 0xa0;
+  else if (*s == 0xed)
+    hi = 0x9f;
+  else if (*s == 0xf0)
+    lo = 0x90;
+  else if (*s == 0xf4)
+    hi = 0x8f;
+  if (s[1] < lo || s[1] > hi)
+    return 0;
+  for (i = 2; i < len; i++)
+    if (s[i] < 0x80 || s[i] > 0xbf)
+      return 0;
+  return len;
+}
 
-    return retval;
+/* Write s as a JSON string.  File names need not be UTF-8, so a byte
+   that is not part of a valid sequence is written as the code point of
+   the same value, as if the name were Latin-1. */
+static void trace_string(const char *s)
+{
+  const unsigned char *p = (const unsigned char *)s;
+  int len;
+
+  putc('"', trace_file);
+  while (*p) {
+    if (*p == '"' || *p == '\\')
+      fprintf(trace_file, "\\%c", *p++);
+    else if (*p < 0x20 || *p == 0x7f)
+      fprintf(trace_file, "\\u%04x", *p++);
+    else if (*p < 0x80)
+      putc(*p++, trace_file);
+    else if ((len = utf8_length(p))) {
+      fwrite(p, 1, len, trace_file);
+      p += len;
+    }
+    else
+      fprintf(trace_file, "\\u%04x", *p++);
+  }
+  putc('"', trace_file);
 }
 
-/* Execute a file */
-void run_part(char *progname)
+/* Start a trace event record common to all event types.  Parts run
+   one after another in lane 1, except for --pipeline where each part
+   has a lane of its own. */
+static void trace_event(const char *phase, const char *category,
+			const char *name, int64_t ts)
 {
-  int result, waited;
-  int pid, r;
-  int pout[2], perr[2];
+  fprintf(trace_file, "%s{\"ph\":\"%s\",\"cat\":\"%s\",\"name\":",
+	  trace_events++ ? ",\n" : "", phase, category);
+  trace_string(name);
+  fprintf(trace_file, ",\"pid\":%d,\"tid\":%d,\"ts\":%lld",
+	  (int)getpid(), trace_tid, (long long)ts);
+}
 
-  waited = 0;
+/* Put the following events in lane tid, naming it on first use */
+static void trace_lane(int tid)
+{
+  trace_tid = tid;
+  if (tid <= trace_lanes)
+    return;
+  trace_lanes = tid;
+  trace_event("M", "__metadata", "thread_name", 0);
+  fprintf(trace_file, ",\"args\":{\"name\":\"slot %d\"}}", tid);
+}
 
-  if (report_mode && (pipe(pout) || pipe(perr))) {
-    error("pipe: %s", strerror(errno));
+/* Start the trace.  The file uses the JSON array format, which trace
+   viewers also accept when the closing bracket is missing after an
+   interrupted run. */
+void trace_open(const char *dirname)
+{
+  if (!(trace_file = fopen(trace_path, "we"))) {
+    error("failed to open trace file %s: %s", trace_path, strerror(errno));
     exit(1);
   }
-  if ((pid = fork()) < 0) {
-    error("failed to fork: %s", strerror(errno));
-    exit(1);
+  fputs("[\n", trace_file);
+  trace_event("M", "__metadata", "process_name", 0);
+  fputs(",\"args\":{\"name\":", trace_file);
+  trace_string(dirname);
+  fputs("}}", trace_file);
+  trace_lane(1);
+}
+
+/* A duration slice such as the directory scan */
+static void trace_slice(const char *name, int64_t start)
+{
+  trace_event("X", "run-parts", name, start);
+  fprintf(trace_file, ",\"dur\":%lld}", (long long)(trace_clock() - start));
+}
+
+/* A burst of output read from a part in --report mode */
+static void trace_output(const char *progname, const char *stream,
+			 ssize_t bytes)
+{
+  trace_event("i", "output", stream, trace_clock());
+  fputs(",\"s\":\"t\",\"args\":{\"part\":", trace_file);
+  trace_string(progname);
+  fprintf(trace_file, ",\"bytes\":%ld}}", (long)bytes);
+}
+
+/* The slice for a finished part, plus an instant event if it failed */
+static void trace_part(const char *progname, pid_t pid, int64_t start,
+		       int result)
+{
+  const char *base;
+  int failed;
+
+  base = strrchr(progname, '/');
+  base = base ? base + 1 : progname;
+  failed = !WIFEXITED(result) || WEXITSTATUS(result);
+
+  trace_event("X", "part", base, start);
+  fprintf(trace_file, ",\"dur\":%lld,\"args\":{\"path\":",
+	  (long long)(trace_clock() - start));
+  trace_string(progname);
+  fprintf(trace_file, ",\"pid\":%d,", (int)pid);
+  if (WIFSIGNALED(result))
+    fprintf(trace_file, "\"signal\":%d}}", WTERMSIG(result));
+  else
+    fprintf(trace_file, "\"exit\":%d}}", WEXITSTATUS(result));
+
+  if (failed) {
+    trace_event("i", "part", "failed", trace_clock());
+    fputs(",\"s\":\"t\",\"args\":{\"part\":", trace_file);
+    trace_string(progname);
+    fputs("}}", trace_file);
   }
-  else if (!pid) {
-    restore_signals();
-    if (new_session_mode)
-      setsid();
-    if (report_mode) {
-      if (dup2(pout[1], STDOUT_FILENO) == -1 ||
-	  dup2(perr[1], STDERR_FILENO) == -1) {
-	error("dup2: %s", strerror(errno));
-	exit(1);
-      }
-      close(pout[0]);
-      close(perr[0]);
-      close(pout[1]);
-      close(perr[1]);
+}
+
+void trace_close(void)
+{
+  fputs("\n]\n", trace_file);
+  if (fclose(trace_file))
+    error("failed to write trace file %s: %s", trace_path, strerror(errno));
+  trace_file = NULL;
+}
+
+static void control_poll(struct timespec *timeout);
+static void finish_part(char *progname, int index, pid_t pid, int64_t start,
+			int result);
+
+/* Hold back the next part while any resource is above its limit */
+void wait_for_capacity(const char *progname)
+{
+  struct timespec interval = { PRESSURE_POLL_INTERVAL, 0 };
+  int64_t start = 0;
+  int i, announced = 0;
+  double value = 0;
+
+  for (;;) {
+    for (i = 0; i < PRESSURE_RESOURCES; i++) {
+      if (pressure_limits[i] < 0)
+	continue;
+      value = read_pressure(i);
+      if (value > pressure_limits[i])
+	break;
     }
-    args[0] = progname;
-    execv(progname, args);
-    error("failed to exec %s: %s", progname, strerror(errno));
-    exit(1);
+    if (i == PRESSURE_RESOURCES)
+      break;
+
+    if (!announced) {
+      if (verbose_mode)
+	fprintf(stderr, "run-parts: delaying %s: %s pressure %.2f above %.2f\n",
+		progname, pressure_names[i], value, pressure_limits[i]);
+      start = trace_clock();
+      announced = 1;
+    }
+    control_poll(&interval);
   }
 
-  if (report_mode) {
-    fd_set set;
-    sigset_t tempmask;
-    struct timespec zero_timeout;
-    struct timespec *the_timeout;
-    int max, printflag;
-    ssize_t c;
-    char buf[4096];
+  if (announced && trace_file)
+    trace_slice("pressure wait", start);
+}
 
-    sigemptyset(&tempmask);
-    sigprocmask(0, NULL, &tempmask);
-    sigdelset(&tempmask, SIGCHLD);
+/* Parse an integer option value within [min, max] */
+static int parse_int(const char *value, int min, int max, int *out)
+{
+  char *end;
+  long n;
 
-    memset(&zero_timeout, 0, sizeof(zero_timeout));
-    the_timeout = NULL;
+  errno = 0;
+  n = strtol(value, &end, 10);
+  if (errno || end == value || *end || n < min || n > max)
+    return -1;
+  *out = n;
+  return 0;
+}
 
-    close(pout[1]);
-    close(perr[1]);
-    max = pout[0] > perr[0] ? pout[0] + 1 : perr[0] + 1;
-    printflag = 0;
+/* Parse a CPU list such as "0-3,6" */
+static int parse_cpu_list(const char *value, cpu_set_t *set)
+{
+  const char *p = value;
+  char *end;
+  long first, last;
 
-    while (pout[0] >= 0 || perr[0] >= 0) {
-      if (!waited) {
-        r = waitpid(pid, &result, WNOHANG);
-        if (r == -1) {
-          error("waitpid: %s", strerror(errno));
-          exit(1);
-        }
-        if (r != 0 && (WIFEXITED(result) || WIFSIGNALED(result))) {
-          /* If the process dies, set a zero timeout. Rarely, some processes
-           * leak file descriptors (e.g., by starting a naughty daemon).
-           * select() would wait forever since the pipes wouldn't close.
-           * We loop, with a zero timeout, until there's no data left, then
-           * give up. This shouldn't affect non-leaky processes. */
-          waited = 1;
-          the_timeout = &zero_timeout;
-        }
-      }
+  CPU_ZERO(set);
+  do {
+    first = last = strtol(p, &end, 10);
+    if (end == p)
+      return -1;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p)
+	return -1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return -1;
+    for (; first <= last; first++)
+      CPU_SET(first, set);
+    p = end + 1;
+  } while (*end == ',');
 
-      FD_ZERO(&set);
-      if (pout[0] >= 0)
-        FD_SET(pout[0], &set);
-      if (perr[0] >= 0)
-        FD_SET(perr[0], &set);
-      r = pselect(max, &set, 0, 0, the_timeout, &tempmask);
+  return *end ? -1 : 0;
+}
 
-      if (r < 0) {
-        if (errno == EINTR)
-            continue;
+/* Store one KEY=VALUE setting; the keys are the option names.  Returns
+   -1 if the value is not valid for the key. */
+int set_limit(struct part_limits *limits, const char *key, const char *value)
+{
+  if (!strcmp(key, "nice"))
+    return parse_int(value, -20, 19, &limits->nice);
 
-        error("select: %s", strerror(errno));
-        exit(1);
-      }
-      else if (r > 0) {
-	if (pout[0] >= 0 && FD_ISSET(pout[0], &set)) {
-	  c = read(pout[0], buf, sizeof(buf));
-	  if (c > 0) {
-	    if (!printflag) {
-	      printf("%s:\n", progname);
-	      fflush(stdout);
-	      printflag = 1;
-	    }
-	    write(STDOUT_FILENO, buf, c);
-	  }
-	  else if (c == 0) {
-	    close(pout[0]);
-	    pout[0] = -1;
-	  }
-	  else if (c < 0) {
-	    close(pout[0]);
-	    pout[0] = -1;
-	    error("failed to read from stdout pipe: %s", strerror (errno)); 
-	  }
-	}
-	if (perr[0] >= 0 && FD_ISSET(perr[0], &set)) {
-	  c = read(perr[0], buf, sizeof(buf));
-	  if (c > 0) {
-	    if (!printflag) {
-	      fprintf(stderr, "%s:\n", progname);
-	      fflush(stderr);
-	      printflag = 1;
-	    }
-	    write(STDERR_FILENO, buf, c);
-	  }
-	  else if (c == 0) {
-	    close(perr[0]);
-	    perr[0] = -1;
-	  }
-	  else if (c < 0) {
-	    close(perr[0]);
-	    perr[0] = -1;
-	    error("failed to read from error pipe: %s", strerror (errno)); 
-	  }
-	}
-      }
-      else if (r == 0 && waited) {
-        /* Zero timeout, no data left. */
-        close(perr[0]);
-        perr[0] = -1;
-        close(pout[0]);
-        pout[0] = -1;
-      }
-      else {
-	/* assert(FALSE): select was called with infinite timeout, so
-	   it either returns successfully or is interrupted */
-      }				/*if */
-    }				/*while */
+  if (!strcmp(key, "ioprio")) {
+    int level = 4;
+
+    if (!strcmp(value, "idle")) {
+      limits->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+      return 0;
+    }
+    if (strncmp(value, "best-effort", 11) ||
+	(value[11] && (value[11] != ':' ||
+		       parse_int(value + 12, 0, 7, &level))))
+      return -1;
+    limits->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+    return 0;
   }
 
-  if (!waited) {
-    r = waitpid(pid, &result, 0);
+  if (!strcmp(key, "sched")) {
+    if (!strcmp(value, "idle"))
+      limits->sched_policy = SCHED_IDLE;
+    else if (!strcmp(value, "batch"))
+      limits->sched_policy = SCHED_BATCH;
+    else if (!strcmp(value, "other"))
+      limits->sched_policy = SCHED_OTHER;
+    else
+      return -1;
+    return 0;
+  }
 
-    if (r == -1) {
-		  error("waitpid: %s", strerror(errno));
-			exit(1);
-    }
+  if (!strcmp(key, "cpu-affinity")) {
+    if (parse_cpu_list(value, &limits->affinity))
+      return -1;
+    limits->have_affinity = 1;
+    return 0;
   }
 
-  if (WIFEXITED(result) && WEXITSTATUS(result)) {
-    error("%s exited with return code %d", progname, WEXITSTATUS(result));
-    exitstatus = 1;
+  if (!strcmp(key, "oom-score-adj"))
+    return parse_int(value, -1000, 1000, &limits->oom_score_adj);
+
+  return -1;
+}
+
+/* Handle one of the per-script setting options */
+void set_default_limit(const char *key, const char *value)
+{
+  if (set_limit(&default_limits, key, value)) {
+    error("bad value `%s' for --%s", value, key);
+    exit(1);
   }
-  else if (WIFSIGNALED(result)) {
-    error("%s exited because of uncaught signal %d", progname,
-	  WTERMSIG(result));
-    exitstatus = 1;
+}
+
+/* Read per-part settings.  Each line names a part followed by
+   KEY=VALUE settings; blank lines and lines starting with # are ignored:
+
+     updatedb  nice=19 ioprio=idle sched=idle
+ */
+void read_part_config(const char *path)
+{
+  struct part_config *config;
+  char line[1024], *name, *setting, *value;
+  int lineno = 0;
+  FILE *f;
+
+  if (!(f = fopen(path, "r"))) {
+    error("failed to open %s: %s", path, strerror(errno));
+    exit(1);
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    if (!(name = strtok(line, " \t\n")) || *name == '#')
+      continue;
+
+    if (!(config = malloc(sizeof(*config))) ||
+	!(config->name = strdup(name))) {
+      error("failed to allocate memory for part config: %s", strerror(errno));
+      exit(1);
+    }
+    config->limits.nice = LIMIT_UNSET;
+    config->limits.ioprio = LIMIT_UNSET;
+    config->limits.sched_policy = LIMIT_UNSET;
+    config->limits.oom_score_adj = LIMIT_UNSET;
+    config->limits.have_affinity = 0;
+
+    while ((setting = strtok(NULL, " \t\n"))) {
+      if (!(value = strchr(setting, '=')) ||
+	  (*value++ = '\0', set_limit(&config->limits, setting, value))) {
+	error("%s:%d: bad setting `%s'", path, lineno, setting);
+	exit(1);
+      }
+    }
+
+    config->next = part_configs;
+    part_configs = config;
+  }
+
+  fclose(f);
+}
+
+/* Combine the global settings with the overrides for one part */
+static void lookup_limits(const char *progname, struct part_limits *limits)
+{
+  struct part_config *config;
+  const char *base;
+
+  *limits = default_limits;
+
+  base = strrchr(progname, '/');
+  base = base ? base + 1 : progname;
+  for (config = part_configs; config; config = config->next) {
+    if (strcmp(config->name, base))
+      continue;
+    if (config->limits.nice != LIMIT_UNSET)
+      limits->nice = config->limits.nice;
+    if (config->limits.ioprio != LIMIT_UNSET)
+      limits->ioprio = config->limits.ioprio;
+    if (config->limits.sched_policy != LIMIT_UNSET)
+      limits->sched_policy = config->limits.sched_policy;
+    if (config->limits.oom_score_adj != LIMIT_UNSET)
+      limits->oom_score_adj = config->limits.oom_score_adj;
+    if (config->limits.have_affinity) {
+      limits->have_affinity = 1;
+      limits->affinity = config->limits.affinity;
+    }
+    break;
+  }
+}
+
+/* Apply the settings for progname; called in the child before exec */
+static void apply_limits(const char *progname)
+{
+  struct part_limits limits;
+  struct sched_param param;
+  FILE *f;
+
+  lookup_limits(progname, &limits);
+
+  if (limits.sched_policy != LIMIT_UNSET) {
+    memset(&param, 0, sizeof(param));
+    if (sched_setscheduler(0, limits.sched_policy, &param)) {
+      error("failed to set scheduling policy for %s: %s", progname,
+	    strerror(errno));
+      exit(1);
+    }
+  }
+  if (limits.nice != LIMIT_UNSET &&
+      setpriority(PRIO_PROCESS, 0, limits.nice)) {
+    error("failed to set niceness for %s: %s", progname, strerror(errno));
+    exit(1);
+  }
+  if (limits.ioprio != LIMIT_UNSET &&
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, limits.ioprio)) {
+    error("failed to set I/O priority for %s: %s", progname,
+	  strerror(errno));
+    exit(1);
+  }
+  if (limits.have_affinity &&
+      sched_setaffinity(0, sizeof(limits.affinity), &limits.affinity)) {
+    error("failed to set CPU affinity for %s: %s", progname,
+	  strerror(errno));
+    exit(1);
+  }
+  if (limits.oom_score_adj != LIMIT_UNSET) {
+    if (!(f = fopen("/proc/self/oom_score_adj", "w")) ||
+	fprintf(f, "%d\n", limits.oom_score_adj) < 0 || fclose(f)) {
+      error("failed to set OOM score adjustment for %s: %s", progname,
+	    strerror(errno));
+      exit(1);
+    }
+  }
+}
+
+/* Wall clock time in microseconds */
+static int64_t now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Open a seqlock write section on the status board */
+static void status_begin(void)
+{
+  __atomic_store_n(&status_board->seq, status_board->seq + 1,
+		   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void status_end(void)
+{
+  __atomic_store_n(&status_board->seq, status_board->seq + 1,
+		   __ATOMIC_RELEASE);
+}
+
+/* Create the status board for a run over the given directory entries */
+void status_open(struct part *parts, int entries)
+{
+  const char *base;
+  struct stat st;
+  int fd, i;
+
+  status_size = sizeof(struct status_header) +
+    entries * sizeof(struct status_part);
+  if ((fd = open(status_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		 0644)) < 0 || fstat(fd, &st)) {
+    error("failed to create status file %s: %s", status_path,
+	  strerror(errno));
+    exit(1);
+  }
+  /* It is truncated below, so never let it be someone else's file */
+  if (!S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+    error("status file %s is not a regular file owned by us", status_path);
+    exit(1);
+  }
+  if (ftruncate(fd, 0) || ftruncate(fd, status_size)) {
+    error("failed to create status file %s: %s", status_path,
+	  strerror(errno));
+    exit(1);
+  }
+  status_board = mmap(NULL, status_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      fd, 0);
+  if (status_board == MAP_FAILED) {
+    error("failed to map status file %s: %s", status_path, strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  status_parts = (struct status_part *)(status_board + 1);
+
+  /* The file is all zeroes, so seq starts out even */
+  status_begin();
+  status_board->magic = STATUS_MAGIC;
+  status_board->version = STATUS_VERSION;
+  status_board->nparts = entries;
+  status_board->pid = getpid();
+  status_board->current = -1;
+  status_board->started = now_usec();
+  for (i = 0; i < entries; i++) {
+    base = strrchr(parts[i].path, '/');
+    snprintf(status_parts[i].name, STATUS_NAME_MAX, "%s",
+	     base ? base + 1 : parts[i].path);
+    status_parts[i].state = PART_QUEUED;
+  }
+  status_end();
+}
+
+/* Record that the part at index has been started as pid */
+static void status_start(int index, pid_t pid)
+{
+  status_begin();
+  status_board->current = index;
+  status_parts[index].state = PART_RUNNING;
+  status_parts[index].pid = pid;
+  status_parts[index].started = now_usec();
+  status_end();
+}
+
+static void status_output(size_t bytes)
+{
+  status_begin();
+  status_parts[status_board->current].output_bytes += bytes;
+  status_end();
+}
+
+static void status_finish(int index, int result)
+{
+  status_begin();
+  status_parts[index].state = PART_DONE;
+  status_parts[index].status = result;
+  status_parts[index].finished = now_usec();
+  if (status_board->current == index)
+    status_board->current = -1;
+  status_end();
+}
+
+/* Mark a part that was not run, unless it already ran */
+static void status_skip(int index)
+{
+  if (status_parts[index].state != PART_QUEUED)
+    return;
+  status_begin();
+  status_parts[index].state = PART_SKIPPED;
+  status_end();
+}
+
+void status_close(void)
+{
+  status_begin();
+  status_board->finished = now_usec();
+  status_end();
+  munmap(status_board, status_size);
+  status_board = NULL;
+}
+
+/* Copy all of stdin to fd, with splice() when stdin is a pipe */
+static void stdin_copy(int fd)
+{
+  char buf[65536];
+  ssize_t c, w, off;
+  int use_splice = 1;
+
+  for (;;) {
+    if (use_splice) {
+      c = splice(STDIN_FILENO, NULL, fd, NULL, 1 << 20, SPLICE_F_MOVE);
+      if (c < 0 && errno == EINVAL) {
+	use_splice = 0;
+	continue;
+      }
+    }
+    else if ((c = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+      for (off = 0; off < c; off += w)
+	if ((w = write(fd, buf + off, c - off)) < 0) {
+	  if (errno == EINTR) {
+	    w = 0;
+	    continue;
+	  }
+	  error("failed to buffer stdin: %s", strerror(errno));
+	  exit(1);
+	}
+    }
+    if (c == 0)
+      return;
+    if (c < 0 && errno != EINTR) {
+      error("failed to read stdin: %s", strerror(errno));
+      exit(1);
+    }
+  }
+}
+
+/* Read stdin once for --stdin-fanout.  A regular file is rewound for
+   every part instead of being copied; anything else goes to a sealed
+   memfd, so no part can change what the next one sees.  Without memfd
+   sealing, the copy goes to an unlinked file without write permission
+   that is only kept open for reading. */
+void stdin_fanout_open(void)
+{
+  char path[PATH_MAX];
+  const char *tmpdir;
+  struct stat st;
+  int fd;
+
+  if (fstat(STDIN_FILENO, &st)) {
+    error("failed to stat stdin: %s", strerror(errno));
+    exit(1);
+  }
+  if (S_ISREG(st.st_mode) &&
+      (stdin_offset = lseek(STDIN_FILENO, 0, SEEK_CUR)) >= 0) {
+    stdin_fd = STDIN_FILENO;
+    return;
+  }
+  stdin_offset = 0;
+
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+  stdin_fd = memfd_create("run-parts-stdin", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (stdin_fd >= 0) {
+    stdin_copy(stdin_fd);
+    if (fcntl(stdin_fd, F_ADD_SEALS,
+	      F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)) {
+      error("failed to seal stdin buffer: %s", strerror(errno));
+      exit(1);
+    }
+    return;
+  }
+#endif /* HAVE_MEMFD_CREATE && F_ADD_SEALS */
+
+  if (!(tmpdir = getenv("TMPDIR")) || !*tmpdir)
+    tmpdir = "/tmp";
+  if (snprintf(path, sizeof(path), "%s/run-parts-stdin.XXXXXX", tmpdir) >=
+      (int)sizeof(path)) {
+    error("failed to create stdin buffer: %s", strerror(ENAMETOOLONG));
+    exit(1);
+  }
+  if ((fd = mkostemp(path, O_CLOEXEC)) < 0) {
+    error("failed to create stdin buffer: %s", strerror(errno));
+    exit(1);
+  }
+  /* Write permission is only checked on open, so fd stays writable */
+  if (fchmod(fd, S_IRUSR) ||
+      (stdin_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    error("failed to create stdin buffer: %s", strerror(errno));
+    unlink(path);
+    exit(1);
+  }
+  unlink(path);
+  stdin_copy(fd);
+  close(fd);
+}
+
+/* Rewind the buffered stdin before starting a part */
+static void stdin_fanout_rewind(void)
+{
+  if (lseek(stdin_fd, stdin_offset, SEEK_SET) < 0) {
+    error("failed to rewind stdin: %s", strerror(errno));
+    exit(1);
+  }
+}
+
+/* Connect to journald, or to whatever stands in for it at the path
+   given with --journal */
+void journal_open(void)
+{
+  memset(&journal_addr, 0, sizeof(journal_addr));
+  journal_addr.sun_family = AF_UNIX;
+  if (strlen(journal_path) >= sizeof(journal_addr.sun_path)) {
+    error("journal socket path %s is too long", journal_path);
+    exit(1);
+  }
+  strcpy(journal_addr.sun_path, journal_path);
+
+  if ((journal_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+    error("socket: %s", strerror(errno));
+    exit(1);
+  }
+}
+
+/* Append a field in the journal native protocol.  Values containing a
+   newline need the binary form with a little-endian length. */
+static char *journal_field(char *p, const char *name, const char *value,
+			   size_t len)
+{
+  int i;
+
+  p = stpcpy(p, name);
+  if (memchr(value, '\n', len)) {
+    *p++ = '\n';
+    for (i = 0; i < 8; i++)
+      *p++ = (uint64_t)len >> (8 * i);
+  }
+  else
+    *p++ = '=';
+  memcpy(p, value, len);
+  p += len;
+  *p++ = '\n';
+  return p;
+}
+
+/* Messages too large for a datagram are passed in a sealed memfd */
+static int journal_send_memfd(const struct iovec *iov)
+{
+#ifdef HAVE_MEMFD_CREATE
+  union {
+    struct cmsghdr cmsg;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int fd, r;
+
+  if ((fd = memfd_create("run-parts-journal",
+			 MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+    return -1;
+  if (write(fd, iov->iov_base, iov->iov_len) != (ssize_t)iov->iov_len ||
+      fcntl(fd, F_ADD_SEALS,
+	    F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)) {
+    close(fd);
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_name = &journal_addr;
+  msg.msg_namelen = sizeof(journal_addr);
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  r = sendmsg(journal_fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+  close(fd);
+  return r;
+#else
+  errno = EMSGSIZE;
+  return -1;
+#endif /* HAVE_MEMFD_CREATE */
+}
+
+/* Send the queued entries.  If journald goes away, say so once and
+   write the lines to our own stdout and stderr from then on. */
+static void journal_flush(void)
+{
+  struct mmsghdr msgs[JOURNAL_BATCH];
+  struct journal_msg *m;
+  int i, sent;
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < journal_count; i++) {
+    msgs[i].msg_hdr.msg_name = &journal_addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(journal_addr);
+    msgs[i].msg_hdr.msg_iov = &journal_msgs[i].iov;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  for (i = 0; i < journal_count; i += sent) {
+    if (!journal_failed) {
+      if ((sent = sendmmsg(journal_fd, msgs + i, journal_count - i,
+			   MSG_NOSIGNAL)) > 0)
+	continue;
+      sent = 0;
+      if (errno == EINTR)
+	continue;
+      if (errno == EMSGSIZE && !journal_send_memfd(&journal_msgs[i].iov)) {
+	sent = 1;
+	continue;
+      }
+      error("failed to write to journal %s: %s", journal_path,
+	    strerror(errno));
+      journal_failed = 1;
+    }
+    m = &journal_msgs[i];
+    write(m->stream, journal_buffer + m->message, m->length);
+    write(m->stream, "\n", 1);
+    sent = 1;
+  }
+  journal_count = 0;
+  journal_used = 0;
+}
+
+/* Queue one line of a part's output */
+static void journal_entry(const char *progname, pid_t pid, int stream,
+			  const char *line, size_t len)
+{
+  struct journal_msg *m;
+  const char *base;
+  char pidbuf[16], *p;
+  size_t size;
+
+  base = strrchr(progname, '/');
+  base = base ? base + 1 : progname;
+  snprintf(pidbuf, sizeof(pidbuf), "%d", (int)pid);
+
+  /* Name, separator or length, and newline for each of 7 fields */
+  size = len + 2 * strlen(progname) + strlen(journal_dir) + strlen(pidbuf) +
+    7 * 10 + sizeof("MESSAGE" "PRIORITY" "6" "SYSLOG_IDENTIFIER" "PART"
+		    "PART_PID" "STREAM" "stdout" "RUNPARTS_DIR");
+  if (journal_count == JOURNAL_BATCH ||
+      journal_used + size > sizeof(journal_buffer))
+    journal_flush();
+  if (size > sizeof(journal_buffer))
+    return;
+
+  m = &journal_msgs[journal_count++];
+  m->stream = stream;
+  m->iov.iov_base = p = journal_buffer + journal_used;
+  m->message = journal_used + sizeof("MESSAGE");
+  m->length = len;
+  p = journal_field(p, "MESSAGE", line, len);
+  if (memchr(line, '\n', len))
+    m->message += 8;
+  p = journal_field(p, "PRIORITY", stream == STDERR_FILENO ? "3" : "6", 1);
+  p = journal_field(p, "SYSLOG_IDENTIFIER", base, strlen(base));
+  p = journal_field(p, "PART", progname, strlen(progname));
+  p = journal_field(p, "PART_PID", pidbuf, strlen(pidbuf));
+  p = journal_field(p, "STREAM", stream == STDERR_FILENO ? "stderr" : "stdout",
+		    6);
+  p = journal_field(p, "RUNPARTS_DIR", journal_dir, strlen(journal_dir));
+  m->iov.iov_len = p - (char *)m->iov.iov_base;
+  journal_used += m->iov.iov_len;
+}
+
+/* Split output read from a part into lines for the journal; the lines
+   from one read() go out together */
+static void journal_output(const char *progname, pid_t pid, int stream,
+			   const char *data, size_t len)
+{
+  struct journal_line *line = &journal_lines[stream - 1];
+  const char *nl;
+  size_t n;
+
+  while (len > 0) {
+    nl = memchr(data, '\n', len);
+    n = nl ? (size_t)(nl - data) : len;
+    if (n > JOURNAL_LINE_MAX - line->used) {
+      n = JOURNAL_LINE_MAX - line->used;
+      nl = NULL;
+    }
+    memcpy(line->buf + line->used, data, n);
+    line->used += n;
+    data += n;
+    len -= n;
+    if (nl) {
+      data++;
+      len--;
+    }
+    if (nl || line->used == JOURNAL_LINE_MAX) {
+      journal_entry(progname, pid, stream, line->buf, line->used);
+      line->used = 0;
+    }
+  }
+  journal_flush();
+}
+
+/* Send what is left of a part's output when it is done */
+static void journal_finish(const char *progname, pid_t pid)
+{
+  int stream;
+
+  for (stream = STDOUT_FILENO; stream <= STDERR_FILENO; stream++)
+    if (journal_lines[stream - 1].used) {
+      journal_entry(progname, pid, stream, journal_lines[stream - 1].buf,
+		    journal_lines[stream - 1].used);
+      journal_lines[stream - 1].used = 0;
+    }
+  journal_flush();
+}
+
+/* Open the --log-dir, creating it if need be */
+void log_open_dir(void)
+{
+  if (mkdir(log_dir, 0755) && errno != EEXIST) {
+    error("failed to create log directory %s: %s", log_dir, strerror(errno));
+    exit(1);
+  }
+  if ((log_dir_fd = open(log_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    error("failed to open log directory %s: %s", log_dir, strerror(errno));
+    exit(1);
+  }
+}
+
+/* Remove the generations of NAME.log beyond the last log_keep runs,
+   such as those left by an earlier run with a larger --log-keep */
+static void log_prune(const char *base)
+{
+  size_t len = strlen(base);
+  struct dirent *d;
+  const char *gen;
+  char *end;
+  DIR *dir;
+  long n;
+  int fd;
+
+  if ((fd = fcntl(log_dir_fd, F_DUPFD_CLOEXEC, 0)) < 0)
+    return;
+  if (!(dir = fdopendir(fd))) {
+    close(fd);
+    return;
+  }
+  /* The duplicate shares its position with log_dir_fd */
+  rewinddir(dir);
+  while ((d = readdir(dir))) {
+    if (strncmp(d->d_name, base, len) || strncmp(d->d_name + len, ".log.", 5))
+      continue;
+    gen = d->d_name + len + 5;
+    if (!isdigit((unsigned char)*gen))
+      continue;
+    n = strtol(gen, &end, 10);
+    if (*end || n < log_keep)
+      continue;
+    if (unlinkat(log_dir_fd, d->d_name, 0) && errno != ENOENT)
+      error("failed to remove %s/%s: %s", log_dir, d->d_name,
+	    strerror(errno));
+  }
+  closedir(dir);
+}
+
+/* Start a new log for a part, shifting NAME.log to NAME.log.1 and so
+   on so that the last log_keep runs are kept */
+static void log_open(const char *progname)
+{
+  char from[PATH_MAX], to[PATH_MAX];
+  const char *base;
+  int n;
+
+  base = strrchr(progname, '/');
+  base = base ? base + 1 : progname;
+
+  for (n = log_keep - 1; n > 0; n--) {
+    if (n > 1)
+      snprintf(from, sizeof(from), "%s.log.%d", base, n - 1);
+    else
+      snprintf(from, sizeof(from), "%s.log", base);
+    snprintf(to, sizeof(to), "%s.log.%d", base, n);
+    if (renameat(log_dir_fd, from, log_dir_fd, to) && errno != ENOENT)
+      error("failed to rotate %s/%s: %s", log_dir, from, strerror(errno));
+  }
+  log_prune(base);
+
+  snprintf(to, sizeof(to), "%s.log", base);
+  if ((log_fd = openat(log_dir_fd, to, O_WRONLY | O_CREAT | O_TRUNC |
+		       O_CLOEXEC, 0644)) < 0)
+    error("failed to open log file %s/%s: %s", log_dir, to, strerror(errno));
+  log_used = 0;
+}
+
+static void log_write_all(const char *data, size_t len)
+{
+  size_t off;
+  ssize_t w;
+
+  for (off = 0; off < len; off += w)
+    if ((w = write(log_fd, data + off, len - off)) < 0) {
+      if (errno == EINTR) {
+	w = 0;
+	continue;
+      }
+      error("failed to write to log file in %s: %s", log_dir,
+	    strerror(errno));
+      return;
+    }
+}
+
+/* Copy output that is also being relayed to the part's log */
+static void log_write(const char *data, size_t len)
+{
+  if (log_fd < 0)
+    return;
+  if (log_used + len > sizeof(log_buffer)) {
+    log_write_all(log_buffer, log_used);
+    log_used = 0;
+  }
+  if (len >= sizeof(log_buffer)) {
+    log_write_all(data, len);
+    return;
+  }
+  memcpy(log_buffer + log_used, data, len);
+  log_used += len;
+}
+
+static void log_close(void)
+{
+  if (log_fd < 0)
+    return;
+  log_write_all(log_buffer, log_used);
+  log_used = 0;
+  close(log_fd);
+  log_fd = -1;
+}
+
+/* Can the part be run by the --warm-shell server?  Only plain
+   "#!/bin/sh" scripts without per-part settings are, since the
+   server cannot apply those. */
+/* Is the text at p, n bytes of which are there, a parameter that
+   differs between a sourced and an executed script? */
+static int warm_special_at(const char *p, size_t n)
+{
+  static const char *const names[] = {
+    "$0", "${0", "$$", "${$", "$PPID", "${PPID"
+  };
+  size_t i, len;
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    len = strlen(names[i]);
+    if (len <= n && !memcmp(p, names[i], len))
+      return 1;
+  }
+  return 0;
+}
+
+/* Does the script on fd mention $0, $$ or $PPID?  A sourced script
+   sees the server's, which POSIX sh cannot change, so such scripts are
+   executed. */
+static int warm_uses_specials(int fd)
+{
+  /* Keep the bytes that may start a name the next read ends */
+  char buf[4096 + WARM_SPECIAL_MAX - 1];
+  size_t have = 0, i;
+  ssize_t c;
+
+  while ((c = read(fd, buf + have, sizeof(buf) - have)) > 0) {
+    have += c;
+    for (i = 0; i + WARM_SPECIAL_MAX <= have; i++)
+      if (buf[i] == '$' && warm_special_at(buf + i, have - i))
+	return 1;
+    memmove(buf, buf + i, have - i);
+    have -= i;
+  }
+  if (c < 0)
+    return 1;
+  for (i = 0; i < have; i++)
+    if (buf[i] == '$' && warm_special_at(buf + i, have - i))
+      return 1;
+  return 0;
+}
+
+static int warm_eligible(const char *progname)
+{
+  struct part_limits limits;
+  char line[32];
+  ssize_t c;
+  int fd;
+
+  if (new_session_mode || strchr(progname, '\n'))
+    return 0;
+  lookup_limits(progname, &limits);
+  if (limits.nice != LIMIT_UNSET || limits.ioprio != LIMIT_UNSET ||
+      limits.sched_policy != LIMIT_UNSET ||
+      limits.oom_score_adj != LIMIT_UNSET || limits.have_affinity)
+    return 0;
+
+  if ((fd = open(progname, O_RDONLY | O_CLOEXEC)) < 0)
+    return 0;
+  if ((c = read(fd, line, sizeof(line) - 1)) < 2) {
+    close(fd);
+    return 0;
+  }
+  line[c] = '\0';
+  c = line[2] == ' ' ? 3 : 2;
+  if (strncmp(line, "#!", 2) ||
+      strncmp(line + c, WARM_SHELL, strlen(WARM_SHELL)) ||
+      strspn(line + c + strlen(WARM_SHELL), " \t") !=
+      strcspn(line + c + strlen(WARM_SHELL), "\n") ||
+      lseek(fd, 0, SEEK_SET) < 0 || warm_uses_specials(fd)) {
+    close(fd);
+    return 0;
+  }
+  close(fd);
+  return 1;
+}
+
+/* Start the --warm-shell server, passing it the --arg arguments as its
+   positional parameters.  Call this while no descriptors the server
+   should not inherit are open. */
+static int warm_open(void)
+{
+  int request[2], reply[2], in, out, i;
+  char **argv;
+
+  /* The server reads the part's pid and streams from /proc */
+  if (access("/proc/self/fd", F_OK))
+    return -1;
+  if (pipe2(request, O_CLOEXEC))
+    return -1;
+  if (pipe2(reply, O_CLOEXEC)) {
+    close(request[0]);
+    close(request[1]);
+    return -1;
+  }
+
+  if ((warm_pid = fork()) < 0) {
+    error("failed to fork: %s", strerror(errno));
+    exit(1);
+  }
+  else if (!warm_pid) {
+    restore_signals();
+    if ((in = fcntl(request[0], F_DUPFD_CLOEXEC, 10)) < 0 ||
+	(out = fcntl(reply[1], F_DUPFD_CLOEXEC, 10)) < 0 ||
+	dup2(in, 3) < 0 || dup2(out, 4) < 0) {
+      error("dup2: %s", strerror(errno));
+      exit(1);
+    }
+    if (!(argv = calloc(argcount + 5, sizeof(*argv)))) {
+      error("failed to allocate memory: %s", strerror(errno));
+      exit(1);
+    }
+    argv[0] = "sh";
+    argv[1] = "-c";
+    argv[2] = WARM_SHELL_SERVER;
+    argv[3] = "run-parts";
+    for (i = 1; args[i]; i++)
+      argv[3 + i] = args[i];
+    execv(WARM_SHELL, argv);
+    error("failed to exec %s: %s", WARM_SHELL, strerror(errno));
+    exit(1);
+  }
+
+  close(request[0]);
+  close(reply[1]);
+  warm_request = request[1];
+  warm_reply = reply[0];
+  warm_used = 0;
+  fcntl(warm_reply, F_SETFL, O_NONBLOCK);
+  return 0;
+}
+
+/* Stop the server; it exits when it reads end of file */
+static void warm_close(void)
+{
+  if (!warm_pid)
+    return;
+  close(warm_request);
+  close(warm_reply);
+  warm_request = warm_reply = -1;
+  while (waitpid(warm_pid, NULL, 0) < 0 && errno == EINTR)
+    ;
+  warm_pid = 0;
+}
+
+/* Read a line from the server.  Returns 1 with the line, 0 if nohang
+   is set and no whole line is there yet, or -1 if the server is gone. */
+static int warm_line(char *line, size_t size, int nohang)
+{
+  struct pollfd pfd;
+  char *nl;
+  ssize_t c;
+  size_t n;
+
+  for (;;) {
+    if ((nl = memchr(warm_buf, '\n', warm_used))) {
+      n = nl - warm_buf;
+      if (n >= size)
+	n = size - 1;
+      memcpy(line, warm_buf, n);
+      line[n] = '\0';
+      n = nl - warm_buf + 1;
+      warm_used -= n;
+      memmove(warm_buf, warm_buf + n, warm_used);
+      return 1;
+    }
+    if (warm_used == sizeof(warm_buf))
+      return -1;
+
+    c = read(warm_reply, warm_buf + warm_used, sizeof(warm_buf) - warm_used);
+    if (c > 0) {
+      warm_used += c;
+      continue;
+    }
+    if (c == 0 || (errno != EAGAIN && errno != EINTR))
+      return -1;
+    if (nohang)
+      return 0;
+    pfd.fd = warm_reply;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, -1);
+  }
+}
+
+/* Describe one of our descriptors so that the subshell can open it */
+static void warm_stream(char *buf, size_t size, int fd)
+{
+  if (fd < 0)
+    snprintf(buf, size, "-");
+  else
+    snprintf(buf, size, "/proc/%d/fd/%d", (int)getpid(), fd);
+}
+
+/* Ask the server to run a script with the given streams.  Returns the
+   pid of the subshell, or -1 if the server could not run it, in which
+   case the caller runs the script itself. */
+static pid_t warm_start(const char *progname, int in, int out, int err)
+{
+  char streams[3][32], request[PATH_MAX + 128], line[64];
+  struct timespec zero = { 0, 0 };
+  sigset_t pipe_mask, old_mask;
+  size_t len, off;
+  ssize_t w;
+  pid_t pid;
+
+  warm_stream(streams[0], sizeof(streams[0]), in);
+  warm_stream(streams[1], sizeof(streams[1]), out);
+  warm_stream(streams[2], sizeof(streams[2]), err);
+  len = snprintf(request, sizeof(request), "%s %s %s %s\n", streams[0],
+		 streams[1], streams[2], progname);
+  if (len >= sizeof(request))
+    return -1;
+
+  /* A server that has died must not take run-parts with it by SIGPIPE */
+  sigemptyset(&pipe_mask);
+  sigaddset(&pipe_mask, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &pipe_mask, &old_mask);
+  for (off = 0; off < len; off += w)
+    if ((w = write(warm_request, request + off, len - off)) < 0) {
+      if (errno == EINTR) {
+	w = 0;
+	continue;
+      }
+      break;
+    }
+  if (off < len && errno == EPIPE)
+    sigtimedwait(&pipe_mask, NULL, &zero);
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  if (off < len) {
+    if (errno == EPIPE)
+      error("warm shell exited unexpectedly");
+    warm_close();
+    return -1;
+  }
+
+  if (warm_line(line, sizeof(line), 0) < 0) {
+    error("warm shell exited unexpectedly");
+    warm_close();
+    return -1;
+  }
+  /* Without a pid for it, the script has not been started; run it and
+     the rest the usual way */
+  if (!strcmp(line, "nopid")) {
+    warm_line(line, sizeof(line), 0);
+    warm_close();
+    warm_mode = 0;
+    return -1;
+  }
+  if (strncmp(line, "pid ", 4) || (pid = atoi(line + 4)) <= 0) {
+    error("warm shell failed to start %s", progname);
+    return -1;
+  }
+  return pid;
+}
+
+/* Collect the exit status of the script the server is running, as a
+   waitpid() status.  The shell only passes on an exit code, 128 plus the
+   signal number for a script killed by a signal, so by the same
+   convention such codes are reported as deaths by that signal. */
+static int warm_wait(int *result, int nohang)
+{
+  char line[64];
+  int r, status;
+
+  if ((r = warm_line(line, sizeof(line), nohang)) > 0 &&
+      !strncmp(line, "status ", 7)) {
+    status = atoi(line + 7) & 0xff;
+    if (status > 128 && status - 128 < NSIG)
+      *result = status - 128;
+    else
+      *result = status << 8;
+    return 1;
+  }
+  if (!r)
+    return 0;
+  error("warm shell exited unexpectedly");
+  warm_close();
+  *result = 1 << 8;
+  return 1;
+}
+
+static void control_drop(struct control_client *client)
+{
+  close(client->fd);
+  client->fd = -1;
+}
+
+static void control_close(void)
+{
+  int i;
+
+  if (control_fd < 0 || getpid() != control_owner)
+    return;
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    if (control_clients[i].fd >= 0)
+      control_drop(&control_clients[i]);
+  close(control_fd);
+  unlink(control_path);
+  control_fd = -1;
+}
+
+/* Listen for requests on the --control-socket.  The socket is removed
+   again when run-parts exits. */
+void control_open(void)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t mask;
+  int i, r;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(control_path) >= sizeof(addr.sun_path)) {
+    error("control socket path %s is too long", control_path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, control_path);
+
+  control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (control_fd < 0) {
+    error("socket: %s", strerror(errno));
+    exit(1);
+  }
+  /* Replace a socket left behind by an earlier run, but nothing else */
+  if (!lstat(control_path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      error("%s exists and is not a socket", control_path);
+      exit(1);
+    }
+    unlink(control_path);
+  }
+  else if (errno != ENOENT) {
+    error("failed to stat %s: %s", control_path, strerror(errno));
+    exit(1);
+  }
+  /* Only the user running run-parts may connect, whatever the umask */
+  mask = umask(0177);
+  r = bind(control_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (r || listen(control_fd, 4)) {
+    error("failed to listen on %s: %s", control_path, strerror(errno));
+    exit(1);
+  }
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    control_clients[i].fd = -1;
+  control_owner = getpid();
+  atexit(control_close);
+}
+
+static void control_reply(int fd, const char *format, ...)
+{
+  char buf[512];
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  if (len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+  send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/* Carry out one request.  Each connection carries a single command line:
+
+     list               running script, as "PID NAME"
+     cancel PID|NAME    send SIGTERM to the script's process group
+     pause              start no further scripts
+     resume             start scripts again
+
+   The reply ends with a line starting with "ok" or "error". */
+static void control_request(int fd, char *line)
+{
+  char *command, *target, *base;
+
+  command = strtok(line, " \t\r\n");
+  target = strtok(NULL, " \t\r\n");
+
+  if (!command) {
+    control_reply(fd, "error empty request\n");
+  }
+  else if (!strcmp(command, "list")) {
+    if (running_pid)
+      control_reply(fd, "%d %s\n", (int)running_pid, running_name);
+    control_reply(fd, "ok%s\n", control_paused ? " paused" : "");
+  }
+  else if (!strcmp(command, "cancel")) {
+    base = running_pid ? strrchr(running_name, '/') : NULL;
+    base = base ? base + 1 : running_name;
+    if (!target)
+      control_reply(fd, "error cancel needs a PID or name\n");
+    else if (!running_pid ||
+	     (atoi(target) != running_pid && strcmp(target, base) &&
+	      strcmp(target, running_name)))
+      control_reply(fd, "error %s is not running\n", target);
+    else if (kill(-running_pid, SIGTERM) && kill(running_pid, SIGTERM))
+      control_reply(fd, "error %s\n", strerror(errno));
+    else
+      control_reply(fd, "ok\n");
+  }
+  else if (!strcmp(command, "pause")) {
+    control_paused = 1;
+    control_reply(fd, "ok\n");
+  }
+  else if (!strcmp(command, "resume")) {
+    control_paused = 0;
+    control_reply(fd, "ok\n");
+  }
+  else {
+    control_reply(fd, "error unknown command %s\n", command);
+  }
+}
+
+/* Take new connections from the listening socket.  Their requests are
+   read as they arrive, so a slow client never holds up the run. */
+static void control_accept(void)
+{
+  struct ucred cred;
+  socklen_t len;
+  int fd, i;
+
+  while ((fd = accept4(control_fd, NULL, NULL,
+		       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+	(cred.uid != geteuid() && cred.uid != 0)) {
+      control_reply(fd, "error permission denied\n");
+      close(fd);
+      continue;
+    }
+    for (i = 0; i < CONTROL_CLIENTS && control_clients[i].fd >= 0; i++)
+      ;
+    if (i == CONTROL_CLIENTS) {
+      control_reply(fd, "error busy\n");
+      close(fd);
+      continue;
+    }
+    control_clients[i].fd = fd;
+    control_clients[i].len = 0;
+  }
+}
+
+/* Read what has arrived from a client, and serve the request once its
+   line is complete */
+static void control_read(struct control_client *client)
+{
+  ssize_t c;
+  char *end;
+
+  c = recv(client->fd, client->line + client->len,
+	   sizeof(client->line) - 1 - client->len, MSG_DONTWAIT);
+  if (c < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (c < 0 || (c == 0 && !client->len)) {
+    control_drop(client);
+    return;
+  }
+  client->len += c;
+  client->line[client->len] = '\0';
+  end = memchr(client->line, '\n', client->len);
+  if (!end && c && client->len < sizeof(client->line) - 1)
+    return;
+  control_request(client->fd, client->line);
+  control_drop(client);
+}
+
+/* Add the control socket and its clients to set, and return the new
+   first argument for select() */
+static int control_fdset(fd_set *set, int nfds)
+{
+  int i;
+
+  if (control_fd < 0)
+    return nfds;
+  FD_SET(control_fd, set);
+  if (control_fd >= nfds)
+    nfds = control_fd + 1;
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    if (control_clients[i].fd >= 0) {
+      FD_SET(control_clients[i].fd, set);
+      if (control_clients[i].fd >= nfds)
+	nfds = control_clients[i].fd + 1;
+    }
+  return nfds;
+}
+
+/* Serve whatever select() found ready in a set from control_fdset() */
+static void control_serve(fd_set *set)
+{
+  int i;
+
+  if (control_fd < 0)
+    return;
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    if (control_clients[i].fd >= 0 && FD_ISSET(control_clients[i].fd, set))
+      control_read(&control_clients[i]);
+  if (FD_ISSET(control_fd, set))
+    control_accept();
+}
+
+/* Wait for timeout (or forever if NULL) while serving control requests */
+static void control_poll(struct timespec *timeout)
+{
+  fd_set set;
+  int r;
+
+  if (control_fd < 0) {
+    if (timeout)
+      nanosleep(timeout, NULL);
+    return;
+  }
+
+  FD_ZERO(&set);
+  r = pselect(control_fdset(&set, 0), &set, 0, 0, timeout, NULL);
+  if (r > 0)
+    control_serve(&set);
+}
+
+/* Parse the comma separated field list of --format */
+void set_format(char *spec)
+{
+  char *field;
+  int i;
+
+  for (field = strtok(spec, ","); field; field = strtok(NULL, ",")) {
+    for (i = 0; i < FIELD_COUNT; i++)
+      if (!strcmp(field, field_names[i]))
+	break;
+    if (i == FIELD_COUNT) {
+      error("unknown field `%s' in --format", field);
+      exit(1);
+    }
+    if (format_count == FORMAT_MAX_FIELDS) {
+      error("too many fields in --format");
+      exit(1);
+    }
+    format_fields[format_count++] = i;
+  }
+  if (!format_count) {
+    error("--format needs at least one field");
+    exit(1);
+  }
+}
+
+/* Write all of data to stdout.  This may run from atexit(), so it must
+   not call exit() itself. */
+static void write_all(const char *data, size_t len)
+{
+  ssize_t c;
+
+  while (len) {
+    c = write(STDOUT_FILENO, data, len);
+    if (c < 0) {
+      if (errno == EINTR)
+	continue;
+      error("failed to write output: %s", strerror(errno));
+      _exit(1);
+    }
+    data += c;
+    len -= c;
+  }
+}
+
+/* Write out the --list and --test output collected so far */
+void list_flush(void)
+{
+  size_t len = list_used;
+
+  list_used = 0;
+  write_all(list_buffer, len);
+}
+
+static void list_write(const char *data, size_t len)
+{
+  if (list_used + len > sizeof(list_buffer)) {
+    list_flush();
+    if (len > sizeof(list_buffer)) {
+      write_all(data, len);
+      return;
+    }
+  }
+  memcpy(list_buffer + list_used, data, len);
+  list_used += len;
+}
+
+/* Write a --format text field, with backslash, tab and newline escaped
+   as \\, \t and \n so that they cannot be taken for separators */
+static void list_write_field(const char *data, size_t len)
+{
+  size_t run;
+
+  while (len) {
+    run = 0;
+    while (run < len && data[run] != '\\' && data[run] != '\t' &&
+	   data[run] != '\n')
+      run++;
+    list_write(data, run);
+    if (run == len)
+      break;
+    list_write(data[run] == '\\' ? "\\\\" :
+	       data[run] == '\t' ? "\\t" : "\\n", 2);
+    data += run + 1;
+    len -= run + 1;
+  }
+}
+
+/* The interpreter named on the #! line of a script, if any */
+static void read_interpreter(const char *path, char *interp, size_t size)
+{
+  char line[256];
+  ssize_t c;
+  size_t len;
+  int fd;
+
+  interp[0] = '\0';
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return;
+  c = read(fd, line, sizeof(line) - 1);
+  close(fd);
+  if (c < 2 || line[0] != '#' || line[1] != '!')
+    return;
+  line[c] = '\0';
+
+  len = strspn(line + 2, " \t");
+  len += 2;
+  c = strcspn(line + len, " \t\n");
+  if ((size_t)c >= size)
+    c = size - 1;
+  memcpy(interp, line + len, c);
+  interp[c] = '\0';
+}
+
+/* Print one entry for --list or --test */
+void list_entry(const char *filename, const struct stat *st)
+{
+  char field[512];
+  int i, len;
+
+  if (!format_count) {
+    list_write(filename, strlen(filename));
+    list_write("\n", 1);
+    return;
+  }
+
+  for (i = 0; i < format_count; i++) {
+    if (i)
+      list_write("\t", 1);
+    switch (format_fields[i]) {
+    case FIELD_PATH:
+      list_write_field(filename, strlen(filename));
+      continue;
+    case FIELD_SIZE:
+      len = snprintf(field, sizeof(field), "%lld", (long long)st->st_size);
+      break;
+    case FIELD_MODE:
+      len = snprintf(field, sizeof(field), "%o", (unsigned)st->st_mode);
+      break;
+    case FIELD_UID:
+      len = snprintf(field, sizeof(field), "%u", (unsigned)st->st_uid);
+      break;
+    case FIELD_GID:
+      len = snprintf(field, sizeof(field), "%u", (unsigned)st->st_gid);
+      break;
+    case FIELD_MTIME:
+      len = snprintf(field, sizeof(field), "%lld.%09ld",
+		     (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+      break;
+    case FIELD_INODE:
+      len = snprintf(field, sizeof(field), "%llu",
+		     (unsigned long long)st->st_ino);
+      break;
+    case FIELD_EXEC:
+      len = snprintf(field, sizeof(field), "%d", !access(filename, X_OK));
+      break;
+    default:
+      read_interpreter(filename, field, sizeof(field));
+      list_write_field(field, strlen(field));
+      continue;
+    }
+    list_write(field, len);
+  }
+  list_write("", 1);
+}
+
+/* Add an argument to the commands that we will call.  Called once for
+   every argument. */
+void add_argument(char *newarg)
+{
+  if (argcount + 1 >= argsize) {
+    argsize = argsize ? argsize * 2 : 4;
+    args = realloc(args, argsize * (sizeof(char *)));
+    if (!args) {
+      error("failed to reallocate memory for arguments: %s", strerror(errno));
+      exit(1);
+    }
+  }
+  args[argcount++] = newarg;
+  args[argcount] = 0;
+}
+
+/* Find the "]" ending the character class, equivalence class or
+   collating symbol ("[:alpha:]", "[=a=]", "[.-.]") at p, if p starts one */
+static const char *bracket_item_end(const char *p)
+{
+  const char *e;
+
+  if (p[0] != '[' || (p[1] != ':' && p[1] != '=' && p[1] != '.'))
+    return NULL;
+  for (e = p + 2; *e; e++)
+    if (e[0] == p[1] && e[1] == ']')
+      return e + 1;
+  return NULL;
+}
+
+/* Find the "]" closing the bracket expression at p, if there is one */
+static const char *bracket_end(const char *p)
+{
+  const char *e;
+
+  p++;
+  if (*p == '!' || *p == '^')
+    p++;
+  if (*p == ']')
+    p++;
+  for (; *p && *p != ']'; p++) {
+    if ((e = bracket_item_end(p)))
+      p = e;
+    else if (*p == '\\' && p[1])
+      p++;
+  }
+  return *p ? p : NULL;
+}
+
+/* Add a filename filter; shell patterns are translated into an
+   equivalent anchored ERE so that all filters end up in one matcher. */
+void add_filter(const char *pattern, int glob, int exclude)
+{
+  const char *p, *start, *end, *e;
+  char *ere, *q;
+
+  filters = realloc(filters, (filtercount + 1) * sizeof(*filters));
+  /* Every character may become a "[.c.]" collating symbol, plus "^",
+     "$" and NUL */
+  if (!filters || !(ere = malloc(5 * strlen(pattern) + 3))) {
+    error("failed to allocate memory for filters: %s", strerror(errno));
+    exit(1);
+  }
+
+  if (!glob) {
+    strcpy(ere, pattern);
+  }
+  else {
+    q = ere;
+    *q++ = '^';
+    for (p = pattern; *p; p++) {
+      if (*p == '*') {
+	*q++ = '.';
+	*q++ = '*';
+      }
+      else if (*p == '?') {
+	*q++ = '.';
+      }
+      else if (*p == '[' && (end = bracket_end(p))) {
+	/* Bracket expressions are the same but for the negation and
+	   escapes.  A backslash is an ordinary character inside an ERE
+	   bracket, so characters that are special there are written as
+	   collating symbols instead. */
+	*q++ = *p++;
+	if (*p == '!' || *p == '^') {
+	  *q++ = '^';
+	  p++;
+	}
+	for (start = p; p < end; p++) {
+	  if ((e = bracket_item_end(p))) {
+	    while (p < e)
+	      *q++ = *p++;
+	    *q++ = *p;
+	    continue;
+	  }
+	  if (*p == '-' && p != start && p + 1 != end) {
+	    *q++ = '-';
+	    continue;
+	  }
+	  if (*p == '\\' && p + 1 < end)
+	    p++;
+	  if (strchr("[]-^", *p))
+	    q += sprintf(q, "[.%c.]", *p);
+	  else
+	    *q++ = *p;
+	}
+	*q++ = ']';
+      }
+      else {
+	if (*p == '\\' && p[1])
+	  p++;
+	if (strchr(".[](){}*+?|^$\\", *p))
+	  *q++ = '\\';
+	*q++ = *p;
+      }
+    }
+    *q++ = '$';
+    *q = '\0';
+  }
+
+  filters[filtercount].ere = ere;
+  filters[filtercount].exclude = exclude;
+  /* As with fnmatch(3) FNM_PERIOD, a leading dot is only matched by a
+     dot in the pattern, never by a wildcard or bracket expression */
+  filters[filtercount].leading_dot = glob && *pattern != '.' &&
+    !(pattern[0] == '\\' && pattern[1] == '.');
+  filtercount++;
+}
+
+/* True or false? Is this a valid filename? */
+int valid_filename(const char *s)
+{
+    unsigned int  retval;
+    uint32_t      matched;
+
+    matched = matcher_match(&name_matcher, s);
+    if (*s == '.')
+        matched &= ~leading_dot_mask;
+
+    if (regex_mode == RUNPARTS_ERE)
+        retval = !!(matched & include_mask);
+
+    else if (regex_mode == RUNPARTS_LSBSYSINIT) {
+
+        if (matched & hierre)
+            retval = !(matched & excsre);
+
+	else
+            retval = !!(matched & tradre);
+
+    } else
+        retval = !!(matched & classicalre);
+
+    if (matched & exclude_mask)
+        retval = 0;
+
+    PROBE2(filter, s, retval);
+    return retval;
+}
+
+int valid_name(const struct dirent *d)
+{
+    return valid_filename(d->d_name);
+}
+
+/* Exec a part in the child.  A part whose digest was checked is run
+   from the descriptor it was read through, so that the file run is the
+   one checked even if its path has been replaced since. */
+static void exec_part(char *progname, int exec_fd)
+{
+  char magic[2];
+
+  args[0] = progname;
+  if (exec_fd < 0)
+    execv(progname, args);
+  else {
+    /* The kernel runs a script's interpreter on /dev/fd/N, so only then
+       leave it open across the exec; a binary should not inherit it */
+    if (pread(exec_fd, magic, 2, 0) == 2 && magic[0] == '#' &&
+	magic[1] == '!')
+      fcntl(exec_fd, F_SETFD, 0);
+    fexecve(exec_fd, args, environ);
+  }
+  error("failed to exec %s: %s", progname, strerror(errno));
+  exit(1);
+}
+
+/* Wait until a part may be started, for the control socket and
+   --max-pressure, and announce it with --verbose */
+static void launch_part(const char *progname)
+{
+  char **a;
+
+  if (control_paused) {
+    if (verbose_mode)
+      fprintf(stderr, "run-parts: paused before %s\n", progname);
+    while (control_paused)
+      control_poll(NULL);
+  }
+  if (pressure_mode)
+    wait_for_capacity(progname);
+  if (verbose_mode) {
+    fprintf(stderr, "run-parts: executing %s", progname);
+    for (a = args + 1; *a; a++)
+      fprintf(stderr, " %s", *a);
+    fprintf(stderr, "\n");
+  }
+}
+
+/* Execute a file; index is its position on the status board and
+   exec_fd, if not -1, the descriptor to run it from */
+void run_part(char *progname, int index, int exec_fd)
+{
+  int result, waited;
+  int pid, r;
+  int pout[2] = { -1, -1 }, perr[2] = { -1, -1 };
+  int capture = report_mode || journal_fd >= 0;
+  int warm = warm_mode && exec_fd < 0 && warm_eligible(progname);
+  int64_t start = 0;
+
+  waited = 0;
+
+  /* Start the server first, so that it does not inherit our pipes */
+  if (warm && !warm_pid && warm_open())
+    warm = 0;
+  if (capture && (pipe(pout) || pipe(perr))) {
+    error("pipe: %s", strerror(errno));
+    exit(1);
+  }
+  if (log_dir_fd >= 0)
+    log_open(progname);
+  if (stdin_fd >= 0)
+    stdin_fanout_rewind();
+  if (trace_file) {
+    /* Keep a failed exec in the child from flushing our buffer again */
+    fflush(trace_file);
+    start = trace_clock();
+  }
+  if (warm &&
+      (pid = warm_start(progname, stdin_fd > STDIN_FILENO ? stdin_fd : -1,
+			capture ? pout[1] : log_fd,
+			capture ? perr[1] : log_fd)) < 0)
+    warm = 0;
+  if (!warm && (pid = fork()) < 0) {
+    error("failed to fork: %s", strerror(errno));
+    exit(1);
+  }
+  else if (!warm && !pid) {
+    restore_signals();
+    if (new_session_mode)
+      setsid();
+    else if (control_fd >= 0)
+      setpgid(0, 0);
+    apply_limits(progname);
+    if (stdin_fd > STDIN_FILENO && dup2(stdin_fd, STDIN_FILENO) == -1) {
+      error("dup2: %s", strerror(errno));
+      exit(1);
+    }
+    if (capture) {
+      if (dup2(pout[1], STDOUT_FILENO) == -1 ||
+	  dup2(perr[1], STDERR_FILENO) == -1) {
+	error("dup2: %s", strerror(errno));
+	exit(1);
+      }
+      close(pout[0]);
+      close(perr[0]);
+      close(pout[1]);
+      close(perr[1]);
+    }
+    /* Without anything to relay to, write straight to the log */
+    else if (log_fd >= 0 && (dup2(log_fd, STDOUT_FILENO) == -1 ||
+			     dup2(log_fd, STDERR_FILENO) == -1)) {
+      error("dup2: %s", strerror(errno));
+      exit(1);
+    }
+    exec_part(progname, exec_fd);
+  }
+
+  PROBE2(part__start, progname, pid);
+  if (status_board)
+    status_start(index, pid);
+
+  if (control_fd >= 0) {
+    /* Also done in the child; whichever runs first wins the race */
+    if (!new_session_mode && !warm)
+      setpgid(pid, pid);
+    running_pid = pid;
+    running_name = progname;
+  }
+
+  if (capture || control_fd >= 0) {
+    fd_set set;
+    sigset_t tempmask;
+    struct timespec zero_timeout;
+    struct timespec *the_timeout;
+    int max, printflag;
+    ssize_t c;
+    char buf[4096];
+
+    sigemptyset(&tempmask);
+    sigprocmask(0, NULL, &tempmask);
+    sigdelset(&tempmask, SIGCHLD);
+
+    memset(&zero_timeout, 0, sizeof(zero_timeout));
+    the_timeout = NULL;
+
+    if (capture) {
+      close(pout[1]);
+      close(perr[1]);
+    }
+    max = pout[0] > perr[0] ? pout[0] : perr[0];
+    if (warm && warm_reply > max)
+      max = warm_reply;
+    max++;
+    printflag = 0;
+
+    while (!waited || pout[0] >= 0 || perr[0] >= 0) {
+      if (!waited) {
+        r = warm ? warm_wait(&result, 1) : waitpid(pid, &result, WNOHANG);
+        if (r == -1) {
+          error("waitpid: %s", strerror(errno));
+          exit(1);
+        }
+        if (r != 0 && (WIFEXITED(result) || WIFSIGNALED(result))) {
+          /* If the process dies, set a zero timeout. Rarely, some processes
+           * leak file descriptors (e.g., by starting a naughty daemon).
+           * select() would wait forever since the pipes wouldn't close.
+           * We loop, with a zero timeout, until there's no data left, then
+           * give up. This shouldn't affect non-leaky processes. */
+          waited = 1;
+          the_timeout = &zero_timeout;
+        }
+      }
+
+      FD_ZERO(&set);
+      if (pout[0] >= 0)
+        FD_SET(pout[0], &set);
+      if (perr[0] >= 0)
+        FD_SET(perr[0], &set);
+      if (warm && !waited)
+        FD_SET(warm_reply, &set);
+      r = pselect(control_fdset(&set, max), &set, 0, 0, the_timeout,
+		  &tempmask);
+
+      if (r < 0) {
+        if (errno == EINTR)
+            continue;
+
+        error("select: %s", strerror(errno));
+        exit(1);
+      }
+      else if (r > 0) {
+	control_serve(&set);
+	if (pout[0] >= 0 && FD_ISSET(pout[0], &set)) {
+	  c = read(pout[0], buf, sizeof(buf));
+	  if (c > 0) {
+	    if (status_board)
+	      status_output(c);
+	    PROBE3(part__output, progname, STDOUT_FILENO, c);
+	    if (trace_file)
+	      trace_output(progname, "stdout", c);
+	    log_write(buf, c);
+	    if (journal_fd >= 0)
+	      journal_output(progname, pid, STDOUT_FILENO, buf, c);
+	    else {
+	      if (!printflag) {
+		printf("%s:\n", progname);
+		fflush(stdout);
+		printflag = 1;
+	      }
+	      write(STDOUT_FILENO, buf, c);
+	    }
+	  }
+	  else if (c == 0) {
+	    close(pout[0]);
+	    pout[0] = -1;
+	  }
+	  else if (c < 0) {
+	    close(pout[0]);
+	    pout[0] = -1;
+	    error("failed to read from stdout pipe: %s", strerror (errno)); 
+	  }
+	}
+	if (perr[0] >= 0 && FD_ISSET(perr[0], &set)) {
+	  c = read(perr[0], buf, sizeof(buf));
+	  if (c > 0) {
+	    if (status_board)
+	      status_output(c);
+	    PROBE3(part__output, progname, STDERR_FILENO, c);
+	    if (trace_file)
+	      trace_output(progname, "stderr", c);
+	    log_write(buf, c);
+	    if (journal_fd >= 0)
+	      journal_output(progname, pid, STDERR_FILENO, buf, c);
+	    else {
+	      if (!printflag) {
+		fprintf(stderr, "%s:\n", progname);
+		fflush(stderr);
+		printflag = 1;
+	      }
+	      write(STDERR_FILENO, buf, c);
+	    }
+	  }
+	  else if (c == 0) {
+	    close(perr[0]);
+	    perr[0] = -1;
+	  }
+	  else if (c < 0) {
+	    close(perr[0]);
+	    perr[0] = -1;
+	    error("failed to read from error pipe: %s", strerror (errno)); 
+	  }
+	}
+      }
+      else if (r == 0 && waited) {
+        /* Zero timeout, no data left. */
+        close(perr[0]);
+        perr[0] = -1;
+        close(pout[0]);
+        pout[0] = -1;
+      }
+      else {
+	/* assert(FALSE): select was called with infinite timeout, so
+	   it either returns successfully or is interrupted */
+      }				/*if */
+    }				/*while */
+  }
+
+  if (!waited) {
+    r = warm ? warm_wait(&result, 0) : waitpid(pid, &result, 0);
+
+    if (r == -1) {
+		  error("waitpid: %s", strerror(errno));
+			exit(1);
+    }
+  }
+
+  running_pid = 0;
+  log_close();
+  if (journal_fd >= 0)
+    journal_finish(progname, pid);
+  finish_part(progname, index, pid, start, result);
+}
+
+/* Run the parts at indexes concurrently for --pipeline, each reading
+   the output of the one before from a pipe.  Every part's status is
+   reported, so a failure anywhere in the chain fails the run, like a
+   shell pipeline with pipefail set. */
+void run_pipeline(struct part *parts, int *indexes, int count)
+{
+  pid_t *pids, pid, leader = 0;
+  int64_t *starts;
+  int p[2] = { -1, -1 }, prev = -1, remaining, result, k;
+  sigset_t tempmask;
+  fd_set set;
+  char *progname;
+
+  pids = calloc(count, sizeof(*pids));
+  starts = calloc(count, sizeof(*starts));
+  if (!pids || !starts) {
+    error("failed to allocate memory for pipeline: %s", strerror(errno));
+    exit(1);
+  }
+  if (trace_file)
+    fflush(trace_file);
+
+  for (k = 0; k < count; k++) {
+    progname = parts[indexes[k]].path;
+    if (k < count - 1 && pipe2(p, O_CLOEXEC)) {
+      error("pipe: %s", strerror(errno));
+      exit(1);
+    }
+    launch_part(progname);
+    if (trace_file)
+      starts[k] = trace_clock();
+    if (log_dir_fd >= 0)
+      log_open(progname);
+    if ((pid = fork()) < 0) {
+      error("failed to fork: %s", strerror(errno));
+      exit(1);
+    }
+    else if (!pid) {
+      restore_signals();
+      if (new_session_mode)
+	setsid();
+      else if (control_fd >= 0)
+	setpgid(0, leader);
+      apply_limits(progname);
+      if ((prev >= 0 && dup2(prev, STDIN_FILENO) == -1) ||
+	  (k < count - 1 && dup2(p[1], STDOUT_FILENO) == -1) ||
+	  (log_fd >= 0 && dup2(log_fd, STDERR_FILENO) == -1)) {
+	error("dup2: %s", strerror(errno));
+	exit(1);
+      }
+      exec_part(progname, parts[indexes[k]].exec_fd);
+    }
+
+    PROBE2(part__start, progname, pid);
+    if (status_board)
+      status_start(indexes[k], pid);
+    /* The whole pipeline shares the first part's process group, so a
+       control socket cancel stops all of it */
+    if (control_fd >= 0 && !new_session_mode)
+      setpgid(pid, leader ? leader : pid);
+    if (!leader) {
+      leader = pid;
+      running_pid = pid;
+      running_name = progname;
+    }
+    pids[k] = pid;
+    log_close();
+
+    if (prev >= 0)
+      close(prev);
+    if (k < count - 1) {
+      close(p[1]);
+      prev = p[0];
+    }
+  }
+
+  sigprocmask(0, NULL, &tempmask);
+  sigdelset(&tempmask, SIGCHLD);
+  for (remaining = count; remaining; ) {
+    pid = waitpid(-1, &result, control_fd >= 0 ? WNOHANG : 0);
+    if (pid < 0) {
+      if (errno == EINTR)
+	continue;
+      error("waitpid: %s", strerror(errno));
+      exit(1);
+    }
+    if (!pid) {
+      /* Serve the control socket until SIGCHLD interrupts us */
+      FD_ZERO(&set);
+      if (pselect(control_fdset(&set, 0), &set, 0, 0, NULL, &tempmask) > 0)
+	control_serve(&set);
+      continue;
+    }
+
+    for (k = 0; k < count && pids[k] != pid; k++)
+      ;
+    if (k == count)
+      continue;
+    pids[k] = 0;
+    remaining--;
+    if (trace_file)
+      trace_lane(k + 1);
+    finish_part(parts[indexes[k]].path, indexes[k], pid, starts[k], result);
+  }
+
+  if (trace_file)
+    trace_lane(1);
+  running_pid = 0;
+  free(pids);
+  free(starts);
+}
+
+/* Record and report the exit of a part */
+static void finish_part(char *progname, int index, pid_t pid, int64_t start,
+			int result)
+{
+  PROBE3(part__exit, progname, pid, result);
+  if (status_board)
+    status_finish(index, result);
+  if (trace_file)
+    trace_part(progname, pid, start, result);
+
+  if (WIFEXITED(result) && WEXITSTATUS(result)) {
+    error("%s exited with return code %d", progname, WEXITSTATUS(result));
+    exitstatus = 1;
+  }
+  else if (WIFSIGNALED(result)) {
+    error("%s exited because of uncaught signal %d", progname,
+	  WTERMSIG(result));
+    exitstatus = 1;
+  }
+}
+
+static void handle_signal(int s)
+{
+    /* Do nothing */
+}
+
+/* Catch SIGCHLD with an empty function to interrupt select() */
+static void catch_signals()
+{
+    struct sigaction act;
+    sigset_t set;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handle_signal;
+    act.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &act, NULL);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+}
+
+/* Unblock signals before execing a child */
+static void restore_signals()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Stat all parts with batches of IORING_OP_STATX requests, so that the
+   lookups overlap instead of paying one round trip each on network and
+   overlay filesystems.  Returns -1 without having done anything if
+   io_uring is not available (old kernel, seccomp, RLIMIT_MEMLOCK). */
+static int stat_parts_uring(struct part *parts, int entries)
+{
+  struct io_uring_params params;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct statx *stx;
+  unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+  size_t sq_size, cq_size, sqes_size;
+  void *sq_ring, *cq_ring;
+  int fd, batch, done, submitted, i, n, r, c;
+
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, URING_MAX_BATCH, &params);
+  if (fd < 0)
+    return -1;
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  batch = params.sq_entries < params.cq_entries ?
+    params.sq_entries : params.cq_entries;
+  stx = malloc(batch * sizeof(*stx));
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED ||
+      !stx) {
+    r = -1;
+    goto out;
+  }
+
+  sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+  sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+  sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+  cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+  cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+  cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+
+  r = 0;
+  for (done = 0; done < entries; done += n) {
+    unsigned tail = *sq_tail, head;
+    int reaped = 0;
+
+    submitted = 0;
+
+    n = entries - done < batch ? entries - done : batch;
+    for (i = 0; i < n; i++, tail++) {
+      struct io_uring_sqe *sqe = &sqes[tail & *sq_mask];
+
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long)parts[done + i].path;
+      sqe->len = STATX_BASIC_STATS;
+      sqe->off = (unsigned long)&stx[i];
+      sqe->user_data = i;
+      sq_array[tail & *sq_mask] = tail & *sq_mask;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* The kernel may take fewer requests than offered, and then returns
+       without waiting; offer the rest again until all are in */
+    while (reaped < n) {
+      c = syscall(__NR_io_uring_enter, fd, n - submitted, n - reaped,
+		  IORING_ENTER_GETEVENTS, NULL, 0);
+      if (c < 0 && (errno == EINTR ||
+		    ((errno == EAGAIN || errno == EBUSY) && submitted > reaped)))
+	continue;
+      if (c < 0 || (!c && submitted < n && submitted == reaped)) {
+	error("io_uring_enter: %s", c < 0 ? strerror(errno) :
+	      "no requests submitted");
+	exit(1);
+      }
+      submitted += c;
+      head = *cq_head;
+      while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+	struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+	struct part *part = &parts[done + cqe->user_data];
+
+	if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+	  /* Kernel without IORING_OP_STATX */
+	  part->stat_errno = stat(part->path, &part->st) ? errno : 0;
+	}
+	else if (cqe->res < 0) {
+	  part->stat_errno = -cqe->res;
+	}
+	else {
+	  statx_to_stat(&stx[cqe->user_data], &part->st);
+	  part->stat_errno = 0;
+	}
+	head++;
+	reaped++;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+
+out:
+  if (sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_size);
+  if (cq_ring != MAP_FAILED)
+    munmap(cq_ring, cq_size);
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqes_size);
+  free(stx);
+  close(fd);
+  return r;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* Fill in the stat() results for all parts */
+static void stat_parts(struct part *parts, int entries)
+{
+  int i;
+
+#ifdef HAVE_LINUX_IO_URING_H
+  if (entries >= URING_MIN_ENTRIES && !stat_parts_uring(parts, entries))
+    return;
+#endif /* HAVE_LINUX_IO_URING_H */
+
+  for (i = 0; i < entries; i++)
+    parts[i].stat_errno = stat(parts[i].path, &parts[i].st) ? errno : 0;
+}
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Process 64-byte blocks of data */
+static void sha256_blocks_generic(uint32_t *state, const unsigned char *data,
+				  size_t blocks)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (; blocks; blocks--, data += 64) {
+    for (i = 0; i < 16; i++)
+      w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+	(uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+    for (; i < 64; i++)
+      w[i] = w[i - 16] + w[i - 7] +
+	(ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+	(ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+      t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+	((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+	((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#ifdef SHA256_SHANI
+/* The same with the SHA extensions found on x86 CPUs since Goldmont and
+   Zen, which run the rounds four at a time.  The state is kept in the
+   ABEF/CDGH word order sha256rnds2 expects. */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state, const unsigned char *data,
+				size_t blocks)
+{
+  const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+				      0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg[4], tmp;
+  int i;
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+  for (; blocks; blocks--, data += 64) {
+    abef = state0;
+    cdgh = state1;
+    for (i = 0; i < 4; i++)
+      msg[i] = _mm_shuffle_epi8(
+	_mm_loadu_si128((const __m128i *)(data + 16 * i)), swap);
+
+    for (i = 0; i < 16; i++) {
+      tmp = _mm_add_epi32(msg[i & 3],
+			  _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+      state0 = _mm_sha256rnds2_epu32(state0, state1,
+				     _mm_shuffle_epi32(tmp, 0x0e));
+      /* Expand the message words for four rounds further on */
+      if (i < 12) {
+	tmp = _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4);
+	msg[i & 3] = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+	msg[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg[i & 3], tmp),
+					  msg[(i + 3) & 3]);
+      }
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);
+  state1 = _mm_shuffle_epi32(state1, 0xb1);
+  _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+  _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+/* Does the CPU have the SHA extensions?  __builtin_cpu_supports() does
+   not know about them in all compilers, so ask cpuid directly. */
+static int sha256_have_shani(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+    return 0;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (ebx & (1 << 29)) != 0;
+}
+#endif /* SHA256_SHANI */
+
+static void sha256_blocks(uint32_t *state, const unsigned char *data,
+			  size_t blocks)
+{
+#ifdef SHA256_SHANI
+  static int shani = -1;
+
+  if (shani < 0)
+    shani = sha256_have_shani();
+  if (shani) {
+    sha256_blocks_shani(state, data, blocks);
+    return;
+  }
+#endif /* SHA256_SHANI */
+  sha256_blocks_generic(state, data, blocks);
+}
+
+static void sha256_init(struct sha256_ctx *ctx)
+{
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(ctx->state, initial, sizeof(initial));
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const unsigned char *data,
+			  size_t len)
+{
+  size_t n;
+
+  ctx->length += len;
+  if (ctx->used) {
+    n = 64 - ctx->used < len ? 64 - ctx->used : len;
+    memcpy(ctx->block + ctx->used, data, n);
+    ctx->used += n;
+    data += n;
+    len -= n;
+    if (ctx->used < 64)
+      return;
+    sha256_blocks(ctx->state, ctx->block, 1);
+    ctx->used = 0;
+  }
+  sha256_blocks(ctx->state, data, len / 64);
+  data += len & ~(size_t)63;
+  len &= 63;
+  memcpy(ctx->block, data, len);
+  ctx->used = len;
+}
+
+static void sha256_final(struct sha256_ctx *ctx, unsigned char *digest)
+{
+  uint64_t bits = ctx->length * 8;
+  int i;
+
+  ctx->block[ctx->used++] = 0x80;
+  if (ctx->used > 56) {
+    memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+    sha256_blocks(ctx->state, ctx->block, 1);
+    ctx->used = 0;
+  }
+  memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+  for (i = 0; i < 8; i++)
+    ctx->block[56 + i] = bits >> (56 - 8 * i);
+  sha256_blocks(ctx->state, ctx->block, 1);
+
+  for (i = 0; i < 32; i++)
+    digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* Compute the SHA-256 digest of the rest of an open file; returns -1
+   with errno set on failure */
+static int sha256_fd(int fd, unsigned char *digest)
+{
+  struct sha256_ctx ctx;
+  unsigned char buf[65536];
+  ssize_t c;
+
+  sha256_init(&ctx);
+  while ((c = read(fd, buf, sizeof(buf))) != 0) {
+    if (c < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    sha256_update(&ctx, buf, c);
+  }
+  sha256_final(&ctx, digest);
+  return 0;
+}
+
+/* Parse a hex string of exactly len bytes */
+static int parse_hex(const char *hex, unsigned char *out, size_t len)
+{
+  unsigned int byte;
+  size_t i;
+
+  if (strlen(hex) != 2 * len)
+    return -1;
+  for (i = 0; i < len; i++) {
+    if (!isxdigit((unsigned char)hex[2 * i]) ||
+	!isxdigit((unsigned char)hex[2 * i + 1]) ||
+	sscanf(hex + 2 * i, "%2x", &byte) != 1)
+      return -1;
+    out[i] = byte;
+  }
+  return 0;
+}
+
+/* Add a part to a growing array */
+static void append_part(struct part **parts, int *entries, char *path)
+{
+  if (!(*entries & (*entries - 1))) {
+    *parts = realloc(*parts, (*entries ? 2 * *entries : 1) * sizeof(**parts));
+    if (!*parts) {
+      error("failed to allocate memory for parts: %s", strerror(errno));
+      exit(1);
+    }
+  }
+  memset(&(*parts)[*entries], 0, sizeof(**parts));
+  (*parts)[*entries].exec_fd = -1;
+  (*parts)[(*entries)++].path = path;
+}
+
+/* Join a directory and a file name */
+static char *join_path(const char *dirname, const char *name)
+{
+  char *path;
+
+  if (!(path = malloc(strlen(dirname) + strlen(name) + 2))) {
+    error("failed to allocate memory for path: %s", strerror(errno));
+    exit(1);
+  }
+  strcpy(path, dirname);
+  strcat(path, "/");
+  strcat(path, name);
+  return path;
+}
+
+/* Collect the valid entries of dirname in lexical order */
+static int scan_directory(const char *dirname, struct part **parts)
+{
+  struct dirent **namelist;
+  int entries, count = 0, i;
+
+  /* scandir() isn't POSIX, but it makes things easy. */
+  entries = scandir(dirname, &namelist, valid_name, alphasort);
+  if (entries < 0) {
+    error("failed to open directory %s: %s", dirname, strerror(errno));
+    exit(1);
+  }
+
+  *parts = NULL;
+  for (i = 0; i < entries; i++) {
+    append_part(parts, &count, join_path(dirname, namelist[i]->d_name));
+    free(namelist[i]);
+  }
+  free(namelist);
+  return count;
+}
+
+/* Read the parts listed in a --from-manifest file, in order.  Each line
+   holds a path, relative to dirname unless absolute, optionally followed
+   by inode=N, mtime=SECONDS[.NANOSECONDS] and sha256=HEX.  Blank lines
+   and lines starting with # are ignored, as are names that do not pass
+   the filename rules. */
+static int read_manifest(const char *dirname, struct part **parts)
+{
+  char line[4096], *name, *base, *field, *value, *end;
+  struct part *part;
+  int count = 0, lineno = 0, digits;
+  size_t len;
+  FILE *f;
+
+  if (!(f = fopen(manifest_path, "re"))) {
+    error("failed to open manifest %s: %s", manifest_path, strerror(errno));
+    exit(1);
+  }
+
+  *parts = NULL;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    len = strlen(line);
+    if (len == sizeof(line) - 1 && line[len - 1] != '\n' && !feof(f)) {
+      error("%s:%d: line too long", manifest_path, lineno);
+      exit(1);
+    }
+    if (!(name = strtok(line, " \t\n")) || *name == '#')
+      continue;
+    base = strrchr(name, '/');
+    if (!valid_filename(base ? base + 1 : name))
+      continue;
+
+    append_part(parts, &count, *name == '/' ? strdup(name) :
+		join_path(dirname, name));
+    part = &(*parts)[count - 1];
+    if (!part->path) {
+      error("failed to allocate memory for path: %s", strerror(errno));
+      exit(1);
+    }
+
+    while ((field = strtok(NULL, " \t\n"))) {
+      if (!(value = strchr(field, '=')))
+	goto bad;
+      *value++ = '\0';
+      errno = 0;
+      if (!strcmp(field, "inode")) {
+	part->inode = strtoull(value, &end, 10);
+	part->check_inode = 1;
+      }
+      else if (!strcmp(field, "mtime")) {
+	part->mtime.tv_sec = strtoll(value, &end, 10);
+	part->mtime.tv_nsec = -1;
+	/* A fraction of a second, of at most nine digits */
+	if (*end == '.') {
+	  part->mtime.tv_nsec = 0;
+	  for (digits = 0, end++; isdigit((unsigned char)*end); end++)
+	    if (++digits > 9)
+	      goto bad;
+	    else
+	      part->mtime.tv_nsec = part->mtime.tv_nsec * 10 + *end - '0';
+	  if (!digits)
+	    goto bad;
+	  for (; digits < 9; digits++)
+	    part->mtime.tv_nsec *= 10;
+	}
+	part->check_mtime = 1;
+      }
+      else if (!strcmp(field, "sha256")) {
+	if (parse_hex(value, part->digest, SHA256_DIGEST_LENGTH))
+	  goto bad;
+	part->check_digest = 1;
+	continue;
+      }
+      else
+	goto bad;
+      if (errno || end == value || *end)
+	goto bad;
+    }
+  }
+
+  fclose(f);
+  return count;
+
+bad:
+  error("%s:%d: bad manifest entry for %s", manifest_path, lineno, name);
+  exit(1);
+}
+
+/* Refuse to trust a --verify or --digest-cache file that someone other
+   than root or the invoking user could have written */
+static void check_trusted(int fd, const char *path)
+{
+  struct stat st;
+
+  if (fstat(fd, &st)) {
+    error("failed to stat %s: %s", path, strerror(errno));
+    exit(1);
+  }
+  if (!S_ISREG(st.st_mode) || (st.st_uid != 0 && st.st_uid != geteuid()) ||
+      (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    error("%s must be a regular file owned by root or by the user running "
+	  "run-parts and not writable by others", path);
+    exit(1);
+  }
+}
+
+static int compare_digest_entries(const void *a, const void *b)
+{
+  const struct digest_entry *x = a, *y = b;
+
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  if (x->ino != y->ino)
+    return x->ino < y->ino ? -1 : 1;
+  return 0;
+}
+
+static int compare_verify_entries(const void *a, const void *b)
+{
+  return strcmp(((const struct verify_entry *)a)->path,
+		((const struct verify_entry *)b)->path);
+}
+
+/* Load the --digest-cache file.  Each line holds the device, inode,
+   size, mtime, ctime and SHA-256 digest of a file that has been hashed
+   before; a missing file is an empty cache.  Lines that do not parse
+   are dropped, as the file is rewritten after the run anyway. */
+static void digest_cache_load(void)
+{
+  unsigned long long dev, ino;
+  long long size, msec, csec;
+  long mnsec, cnsec;
+  char line[256], hex[2 * SHA256_DIGEST_LENGTH + 1];
+  struct digest_entry *entry;
+  FILE *f;
+  int fd;
+
+  if ((fd = open(digest_cache_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) < 0) {
+    if (errno == ENOENT)
+      return;
+    error("failed to open digest cache %s: %s", digest_cache_path,
+	  strerror(errno));
+    exit(1);
+  }
+  check_trusted(fd, digest_cache_path);
+  if (!(f = fdopen(fd, "r"))) {
+    error("failed to open digest cache %s: %s", digest_cache_path,
+	  strerror(errno));
+    exit(1);
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%llu %llu %lld %lld.%ld %lld.%ld %64s", &dev, &ino,
+	       &size, &msec, &mnsec, &csec, &cnsec, hex) != 8)
+      continue;
+    if (digest_cache_count == digest_cache_alloc) {
+      digest_cache_alloc = digest_cache_alloc ? 2 * digest_cache_alloc : 64;
+      digest_cache = realloc(digest_cache,
+			     digest_cache_alloc * sizeof(*digest_cache));
+      if (!digest_cache) {
+	error("failed to allocate memory for digest cache: %s",
+	      strerror(errno));
+	exit(1);
+      }
+    }
+    entry = &digest_cache[digest_cache_count];
+    if (parse_hex(hex, entry->digest, SHA256_DIGEST_LENGTH))
+      continue;
+    entry->dev = dev;
+    entry->ino = ino;
+    entry->size = size;
+    entry->mtime.tv_sec = msec;
+    entry->mtime.tv_nsec = mnsec;
+    entry->ctime.tv_sec = csec;
+    entry->ctime.tv_nsec = cnsec;
+    digest_cache_count++;
+  }
+  fclose(f);
+
+  qsort(digest_cache, digest_cache_count, sizeof(*digest_cache),
+	compare_digest_entries);
+  digest_cache_sorted = digest_cache_count;
+}
+
+/* Find the cache entry for a file, or NULL.  Entries added during this
+   run are unsorted at the end of the array. */
+static struct digest_entry *digest_cache_find(struct stat *st)
+{
+  struct digest_entry key, *entry;
+  int i;
+
+  key.dev = st->st_dev;
+  key.ino = st->st_ino;
+  if ((entry = bsearch(&key, digest_cache, digest_cache_sorted,
+		       sizeof(*digest_cache), compare_digest_entries)))
+    return entry;
+  for (i = digest_cache_sorted; i < digest_cache_count; i++)
+    if (!compare_digest_entries(&key, &digest_cache[i]))
+      return &digest_cache[i];
+  return NULL;
+}
+
+/* Does a cache entry still describe the file?  Any write or chmod
+   changes the ctime, which unlike the mtime cannot be set back. */
+static int digest_cache_valid(struct digest_entry *entry, struct stat *st)
+{
+  return entry->size == st->st_size &&
+    entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+    entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+    entry->ctime.tv_sec == st->st_ctim.tv_sec &&
+    entry->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void digest_cache_store(struct stat *st, const unsigned char *digest)
+{
+  struct digest_entry *entry;
+
+  if (!(entry = digest_cache_find(st))) {
+    if (digest_cache_count == digest_cache_alloc) {
+      digest_cache_alloc = digest_cache_alloc ? 2 * digest_cache_alloc : 64;
+      digest_cache = realloc(digest_cache,
+			     digest_cache_alloc * sizeof(*digest_cache));
+      if (!digest_cache) {
+	error("failed to allocate memory for digest cache: %s",
+	      strerror(errno));
+	exit(1);
+      }
+    }
+    entry = &digest_cache[digest_cache_count++];
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+  }
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->ctime = st->st_ctim;
+  memcpy(entry->digest, digest, SHA256_DIGEST_LENGTH);
+  digest_cache_dirty = 1;
+}
+
+/* Write the cache back if it changed.  It is replaced atomically, so a
+   concurrent run sees either the old or the new cache; losing the race
+   only costs the other run's additions. */
+static void digest_cache_save(void)
+{
+  char *tmp;
+  FILE *f;
+  int fd, i, j;
+
+  if (!digest_cache_dirty)
+    return;
+
+  if (!(tmp = malloc(strlen(digest_cache_path) + 8))) {
+    error("failed to allocate memory for path: %s", strerror(errno));
+    return;
+  }
+  sprintf(tmp, "%s.XXXXXX", digest_cache_path);
+  if ((fd = mkstemp(tmp)) < 0) {
+    error("failed to write digest cache %s: %s", digest_cache_path,
+	  strerror(errno));
+    free(tmp);
+    return;
+  }
+  if (!(f = fdopen(fd, "w"))) {
+    close(fd);
+    goto fail;
+  }
+
+  for (i = 0; i < digest_cache_count; i++) {
+    fprintf(f, "%llu %llu %lld %lld.%09ld %lld.%09ld ",
+	    (unsigned long long)digest_cache[i].dev,
+	    (unsigned long long)digest_cache[i].ino,
+	    (long long)digest_cache[i].size,
+	    (long long)digest_cache[i].mtime.tv_sec,
+	    digest_cache[i].mtime.tv_nsec,
+	    (long long)digest_cache[i].ctime.tv_sec,
+	    digest_cache[i].ctime.tv_nsec);
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+      fprintf(f, "%02x", digest_cache[i].digest[j]);
+    putc('\n', f);
+  }
+  if (fclose(f) || rename(tmp, digest_cache_path))
+    goto fail;
+  free(tmp);
+  return;
+
+fail:
+  error("failed to write digest cache %s: %s", digest_cache_path,
+	strerror(errno));
+  unlink(tmp);
+  free(tmp);
+}
+
+/* The SHA-256 digest of a part, from the --digest-cache when the file
+   has not changed since it was last hashed.  The descriptor it is read
+   through is kept in part->exec_fd, and reused if already open, so the
+   part is later run from the very file hashed. */
+static int part_digest(struct part *part, unsigned char *digest)
+{
+  struct digest_entry *entry;
+  struct stat st;
+  int fd = part->exec_fd, r;
+
+  if (fd < 0 && (fd = open(part->path, O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  if (fstat(fd, &st) || lseek(fd, 0, SEEK_SET) < 0) {
+    r = errno;
+    close(fd);
+    part->exec_fd = -1;
+    errno = r;
+    return -1;
+  }
+  part->exec_fd = fd;
+
+  if (digest_cache_path && (entry = digest_cache_find(&st)) &&
+      digest_cache_valid(entry, &st)) {
+    memcpy(digest, entry->digest, SHA256_DIGEST_LENGTH);
+    return 0;
+  }
+
+  if (!(r = sha256_fd(fd, digest)) && digest_cache_path)
+    digest_cache_store(&st, digest);
+  return r;
+}
+
+/* Read the --verify allowlist, in the format written by sha256sum: a
+   hex digest, a space, a space or an asterisk, and a path relative to
+   dirname unless absolute. */
+static void read_verify_list(const char *dirname)
+{
+  char line[4096], *name, *end;
+  int lineno = 0, alloc = 0;
+  FILE *f;
+  int fd;
+
+  if ((fd = open(verify_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) < 0 ||
+      !(f = fdopen(fd, "r"))) {
+    error("failed to open %s: %s", verify_path, strerror(errno));
+    exit(1);
+  }
+  check_trusted(fd, verify_path);
+
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    if ((end = strchr(line, '\n')))
+      *end = '\0';
+    if (!*line || *line == '#')
+      continue;
+    if (strlen(line) < 2 * SHA256_DIGEST_LENGTH + 3 ||
+	line[2 * SHA256_DIGEST_LENGTH] != ' ' ||
+	(line[2 * SHA256_DIGEST_LENGTH + 1] != ' ' &&
+	 line[2 * SHA256_DIGEST_LENGTH + 1] != '*')) {
+      error("%s:%d: bad digest line", verify_path, lineno);
+      exit(1);
+    }
+    line[2 * SHA256_DIGEST_LENGTH] = '\0';
+    name = line + 2 * SHA256_DIGEST_LENGTH + 2;
+
+    if (verify_count == alloc) {
+      alloc = alloc ? 2 * alloc : 16;
+      if (!(verify_entries = realloc(verify_entries,
+				     alloc * sizeof(*verify_entries)))) {
+	error("failed to allocate memory for %s: %s", verify_path,
+	      strerror(errno));
+	exit(1);
+      }
+    }
+    if (parse_hex(line, verify_entries[verify_count].digest,
+		  SHA256_DIGEST_LENGTH)) {
+      error("%s:%d: bad digest line", verify_path, lineno);
+      exit(1);
+    }
+    verify_entries[verify_count++].path =
+      *name == '/' ? strdup(name) : join_path(dirname, name);
+    if (!verify_entries[verify_count - 1].path) {
+      error("failed to allocate memory for path: %s", strerror(errno));
+      exit(1);
+    }
   }
-}
+  fclose(f);
 
-static void handle_signal(int s)
-{
-    /* Do nothing */
+  qsort(verify_entries, verify_count, sizeof(*verify_entries),
+	compare_verify_entries);
 }
 
-/* Catch SIGCHLD with an empty function to interrupt select() */
-static void catch_signals()
+/* Does the part still look the way the manifest says? */
+static int matches_manifest(struct part *part)
 {
-    struct sigaction act;
-    sigset_t set;
-
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = handle_signal;
-    act.sa_flags = SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &act, NULL);
+  unsigned char digest[SHA256_DIGEST_LENGTH];
 
-    sigemptyset(&set);
-    sigaddset(&set, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &set, NULL);
+  if (part->check_inode && part->st.st_ino != part->inode)
+    return 0;
+  if (part->check_mtime &&
+      (part->st.st_mtim.tv_sec != part->mtime.tv_sec ||
+       (part->mtime.tv_nsec >= 0 &&
+	part->st.st_mtim.tv_nsec != part->mtime.tv_nsec)))
+    return 0;
+  if (part->check_digest &&
+      (part_digest(part, digest) ||
+       memcmp(digest, part->digest, SHA256_DIGEST_LENGTH)))
+    return 0;
+  return 1;
 }
 
-/* Unblock signals before execing a child */
-static void restore_signals()
+/* Is the part listed in the --verify file with its current digest? */
+static int verify_part(struct part *part)
 {
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGCHLD);
-    sigprocmask(SIG_UNBLOCK, &set, NULL);
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  struct verify_entry key, *entry;
+
+  key.path = part->path;
+  entry = bsearch(&key, verify_entries, verify_count, sizeof(*verify_entries),
+		  compare_verify_entries);
+  if (!entry) {
+    error("component %s is not listed in %s", part->path, verify_path);
+    return 0;
+  }
+  if (part_digest(part, digest)) {
+    error("failed to read component %s: %s", part->path, strerror(errno));
+    return 0;
+  }
+  if (memcmp(digest, entry->digest, SHA256_DIGEST_LENGTH)) {
+    error("component %s does not match its digest in %s", part->path,
+	  verify_path);
+    return 0;
+  }
+  return 1;
 }
 
 /* Find the parts to run & call run_part() */
 void run_parts(char *dirname)
 {
-  struct dirent **namelist;
+  struct part *parts;
   char *filename;
-  size_t filename_length, dirname_length;
-  int entries, i, result;
+  int entries, i, *pipeline = NULL, pipeline_count = 0, executable;
+  int64_t start;
   struct stat st;
 
-  /* dirname + "/" */
-  dirname_length = strlen(dirname) + 1;
-  /* dirname + "/" + ".." + "\0" (This will save one realloc.) */
-  filename_length = dirname_length + 2 + 1;
-  if (!(filename = malloc(filename_length))) {
-    error("failed to allocate memory for path: %s", strerror(errno));
-    exit(1);
-  }
-  strcpy(filename, dirname);
-  strcat(filename, "/");
+  if (digest_cache_path)
+    digest_cache_load();
+  if (verify_path && !list_mode)
+    read_verify_list(dirname);
 
-  /* scandir() isn't POSIX, but it makes things easy. */
-  entries = scandir(dirname, &namelist, valid_name, alphasort);
-  if (entries < 0) {
-    error("failed to open directory %s: %s", dirname, strerror(errno));
+  start = trace_file ? trace_clock() : 0;
+  PROBE1(scan__start, dirname);
+  if (manifest_path)
+    entries = read_manifest(dirname, &parts);
+  else
+    entries = scan_directory(dirname, &parts);
+  /* Nothing changes while parts are only listed, so their stat()
+     results can be fetched in one batch.  When running, each entry is
+     looked at when its turn comes instead, as a part before it may
+     have fixed, replaced or removed it. */
+  if (test_mode || list_mode)
+    stat_parts(parts, entries);
+
+  PROBE2(scan__done, dirname, entries);
+  if (trace_file)
+    trace_slice("scan", start);
+
+  if (status_path && !test_mode && !list_mode)
+    status_open(parts, entries);
+  if (pipeline_mode && !test_mode && !list_mode &&
+      !(pipeline = malloc((entries ? entries : 1) * sizeof(*pipeline)))) {
+    error("failed to allocate memory for pipeline: %s", strerror(errno));
     exit(1);
   }
 
   i = reverse_mode ? 0 : entries;
   for (i = reverse_mode ? (entries - 1) : 0;
        reverse_mode ? (i >= 0) : (i < entries); reverse_mode ? i-- : i++) {
-    if (filename_length < dirname_length + strlen(namelist[i]->d_name) + 1) {
-      filename_length = dirname_length + strlen(namelist[i]->d_name) + 1;
-      if (!(filename = realloc(filename, filename_length))) {
-	error("failed to reallocate memory for path: %s", strerror(errno));
-	exit(1);
-      }
-    }
-    strcpy(filename + dirname_length, namelist[i]->d_name);
-
-    strcpy(filename, dirname);
-    strcat(filename, "/");
-    strcat(filename, namelist[i]->d_name);
+    filename = parts[i].path;
+    if (!test_mode && !list_mode)
+      parts[i].stat_errno = stat(filename, &parts[i].st) ? errno : 0;
+    st = parts[i].st;
+    executable = !parts[i].stat_errno && S_ISREG(st.st_mode) &&
+      !access(filename, X_OK);
 
-    result = stat(filename, &st);
-    if (result < 0) {
-      error("failed to stat component %s: %s", filename, strerror(errno));
+    if (parts[i].stat_errno) {
+      error("failed to stat component %s: %s", filename,
+	    strerror(parts[i].stat_errno));
       if (exit_on_error_mode) {
-        exit(1);
+        /* Leave by the common path, which marks the rest skipped */
+        exitstatus = 1;
+        break;
       }
-      else
+      else {
+        if (status_board)
+          status_skip(i);
         continue;
+      }
+    }
+
+    if (manifest_path && !matches_manifest(&parts[i])) {
+      error("component %s does not match the manifest", filename);
+      exitstatus = 1;
+      if (exit_on_error_mode)
+        break;
+      if (parts[i].exec_fd >= 0) {
+        close(parts[i].exec_fd);
+        parts[i].exec_fd = -1;
+      }
+      if (status_board)
+        status_skip(i);
+      continue;
     }
 
     if (S_ISREG(st.st_mode)) {
-      if (!access(filename, X_OK)) {
-	if (test_mode) {
-	  printf("%s\n", filename);
+      if (executable) {
+	if (verify_path && !list_mode && !verify_part(&parts[i])) {
+	  exitstatus = 1;
+	  if (exit_on_error_mode)
+	    break;
+	}
+	else if (test_mode) {
+	  list_entry(filename, &st);
 	}
 	else if (list_mode) {
 	  if (!access(filename, R_OK))
-	    printf("%s\n", filename);
+	    list_entry(filename, &st);
 	}
 	else {
-	  if (verbose_mode)
-	    if (argcount) {
-	      char **a = args;
-
-	      fprintf(stderr, "run-parts: executing %s", filename);
-	      while(*(++a))
-		fprintf(stderr, " %s", *a);
-	      fprintf(stderr, "\n");
-	    } else {
-	      fprintf(stderr, "run-parts: executing %s\n", filename);
-	    }
-	  run_part(filename);
-	  if (exitstatus != 0 && exit_on_error_mode) return;
+	  if (pipeline_mode) {
+	    pipeline[pipeline_count++] = i;
+	    continue;
+	  }
+	  launch_part(filename);
+	  run_part(filename, i, parts[i].exec_fd);
+	  if (exitstatus != 0 && exit_on_error_mode) break;
 	}
       }
       else if (!access(filename, R_OK)) {
 	if (list_mode) {
-	  printf("%s\n", filename);
+	  list_entry(filename, &st);
 	}
       }
       else if (S_ISLNK(st.st_mode)) {
@@ -458,16 +3865,39 @@ void run_parts(char *dirname)
       }
     }
 
-    free(namelist[i]);
+    if (parts[i].exec_fd >= 0) {
+      close(parts[i].exec_fd);
+      parts[i].exec_fd = -1;
+    }
+    if (status_board)
+      status_skip(i);
   }
-  free(namelist);
-  free(filename);
+  if (pipeline_count && !(exitstatus && exit_on_error_mode))
+    run_pipeline(parts, pipeline, pipeline_count);
+  free(pipeline);
+  if (status_board) {
+    for (i = 0; i < entries; i++)
+      status_skip(i);
+    status_close();
+  }
+  warm_close();
+  if (digest_cache_path)
+    digest_cache_save();
+  for (i = 0; i < entries; i++) {
+    if (parts[i].exec_fd >= 0)
+      close(parts[i].exec_fd);
+    free(parts[i].path);
+  }
+  free(parts);
+  for (i = 0; i < verify_count; i++)
+    free(verify_entries[i].path);
+  free(verify_entries);
+  free(digest_cache);
 }
 
 /* Process options */
 int main(int argc, char *argv[])
 {
-  custom_ere = NULL;
   umask(022);
   add_argument(0);
 
@@ -486,9 +3916,31 @@ int main(int argc, char *argv[])
       {"help", 0, 0, 'h'},
       {"version", 0, 0, 'V'},
       {"lsbsysinit", 0, &regex_mode, RUNPARTS_LSBSYSINIT},
-      {"regex", 1, &regex_mode, RUNPARTS_ERE},
+      {"regex", 1, 0, OPT_REGEX},
       {"exit-on-error", 0, &exit_on_error_mode, 1},
       {"new-session", 0, &new_session_mode, 1},
+      {"max-pressure", 1, 0, OPT_MAX_PRESSURE},
+      {"nice", 1, 0, OPT_NICE},
+      {"ioprio", 1, 0, OPT_IOPRIO},
+      {"sched", 1, 0, OPT_SCHED},
+      {"cpu-affinity", 1, 0, OPT_CPU_AFFINITY},
+      {"oom-score-adj", 1, 0, OPT_OOM_SCORE_ADJ},
+      {"part-config", 1, 0, OPT_PART_CONFIG},
+      {"status-file", 1, 0, OPT_STATUS_FILE},
+      {"control-socket", 1, 0, OPT_CONTROL_SOCKET},
+      {"trace", 1, 0, OPT_TRACE},
+      {"include-glob", 1, 0, OPT_INCLUDE_GLOB},
+      {"exclude-glob", 1, 0, OPT_EXCLUDE_GLOB},
+      {"from-manifest", 1, 0, OPT_FROM_MANIFEST},
+      {"format", 1, 0, OPT_FORMAT},
+      {"verify", 1, 0, OPT_VERIFY},
+      {"digest-cache", 1, 0, OPT_DIGEST_CACHE},
+      {"stdin-fanout", 0, &stdin_fanout_mode, 1},
+      {"pipeline", 0, &pipeline_mode, 1},
+      {"journal", 2, 0, OPT_JOURNAL},
+      {"log-dir", 1, 0, OPT_LOG_DIR},
+      {"log-keep", 1, 0, OPT_LOG_KEEP},
+      {"warm-shell", 0, &warm_mode, 1},
       {0, 0, 0, 0}
     };
 
@@ -497,9 +3949,6 @@ int main(int argc, char *argv[])
       break;
     switch (c) {
     case 0:
-      if(option_index==10) { /* hardcoding this will lead to trouble */
-        custom_ere = strdup(optarg);
-      }
       break;
     case 'u':
       set_umask();
@@ -516,6 +3965,57 @@ int main(int argc, char *argv[])
     case 'V':
       version();
       break;
+    case OPT_MAX_PRESSURE:
+      set_pressure_limits(optarg);
+      break;
+    case OPT_NICE:
+    case OPT_IOPRIO:
+    case OPT_SCHED:
+    case OPT_CPU_AFFINITY:
+    case OPT_OOM_SCORE_ADJ:
+      set_default_limit(long_options[option_index].name, optarg);
+      break;
+    case OPT_PART_CONFIG:
+      read_part_config(optarg);
+      break;
+    case OPT_STATUS_FILE:
+      status_path = optarg;
+      break;
+    case OPT_CONTROL_SOCKET:
+      control_path = optarg;
+      break;
+    case OPT_TRACE:
+      trace_path = optarg;
+      break;
+    case OPT_REGEX:
+    case OPT_INCLUDE_GLOB:
+      regex_mode = RUNPARTS_ERE;
+      add_filter(optarg, c == OPT_INCLUDE_GLOB, 0);
+      break;
+    case OPT_EXCLUDE_GLOB:
+      add_filter(optarg, 1, 1);
+      break;
+    case OPT_FROM_MANIFEST:
+      manifest_path = optarg;
+      break;
+    case OPT_FORMAT:
+      set_format(optarg);
+      break;
+    case OPT_VERIFY:
+      verify_path = optarg;
+      break;
+    case OPT_DIGEST_CACHE:
+      digest_cache_path = optarg;
+      break;
+    case OPT_JOURNAL:
+      journal_path = optarg ? optarg : JOURNAL_SOCKET;
+      break;
+    case OPT_LOG_DIR:
+      log_dir = optarg;
+      break;
+    case OPT_LOG_KEEP:
+      set_log_keep(optarg);
+      break;
     default:
       fprintf(stderr, "Try `run-parts --help' for more information.\n");
       exit(1);
@@ -531,14 +4031,46 @@ int main(int argc, char *argv[])
     error("--list and --test can not be used together");
     fprintf(stderr, "Try `run-parts --help' for more information.\n");
     exit(1);
+  } else if (journal_path && report_mode) {
+    error("--journal and --report can not be used together");
+    fprintf(stderr, "Try `run-parts --help' for more information.\n");
+    exit(1);
+  } else if (pipeline_mode &&
+	     (report_mode || journal_path || stdin_fanout_mode)) {
+    error("--pipeline can not be used with --report, --journal or "
+	  "--stdin-fanout");
+    fprintf(stderr, "Try `run-parts --help' for more information.\n");
+    exit(1);
+  } else if (format_count && !list_mode && !test_mode) {
+    error("--format can only be used with --list or --test");
+    fprintf(stderr, "Try `run-parts --help' for more information.\n");
+    exit(1);
   } else {
+    if (list_mode || test_mode)
+      atexit(list_flush);
     catch_signals();
     regex_compile_pattern();
+    if (control_path && !test_mode && !list_mode)
+      control_open();
+    if (stdin_fanout_mode && !test_mode && !list_mode)
+      stdin_fanout_open();
+    if (journal_path && !test_mode && !list_mode) {
+      journal_dir = argv[optind];
+      journal_open();
+    }
+    if (log_dir && !test_mode && !list_mode)
+      log_open_dir();
+    if (trace_path && !test_mode && !list_mode)
+      trace_open(argv[optind]);
     run_parts(argv[optind]);
+    if (trace_file)
+      trace_close();
     regex_clean();
 
     free(args);
-    free(custom_ere);
+    while (filtercount--)
+      free(filters[filtercount].ere);
+    free(filters);
 
     return exitstatus;
   }
@@ -548,44 +4080,42 @@ int main(int argc, char *argv[])
  * Compile patterns used by the application
  *
  * In order for a string to be matched by a pattern, this pattern must be
- * compiled with the regcomp function. If an error occurs, the application
+ * added to the filename matcher. If an error occurs, the application
  * exits and displays the error.
  */
 static void
 regex_compile_pattern (void)
 {
-    int      err;
-    regex_t *pt_regex;
+    uint32_t bit;
+    int      i;
+
+    for (i = 0; i < filtercount; i++) {
+        bit = matcher_add(&name_matcher, filters[i].ere, REG_EXTENDED);
+        if (filters[i].exclude)
+            exclude_mask |= bit;
+        else
+            include_mask |= bit;
+        if (filters[i].leading_dot)
+            leading_dot_mask |= bit;
+    }
 
     if (regex_mode == RUNPARTS_ERE) {
 
-        if ((err = regcomp(&customre, custom_ere,
-                    REG_EXTENDED | REG_NOSUB)) != 0)
-            pt_regex = &customre;
+        /* Only the filters above */
 
     } else if (regex_mode == RUNPARTS_LSBSYSINIT) {
 
-        if ( (err = regcomp(&hierre, "^_?([a-z0-9_.]+-)+[a-z0-9]+$",
-                    REG_EXTENDED | REG_NOSUB)) != 0)
-            pt_regex = &hierre;
-
-        else if ( (err = regcomp(&excsre, "^[a-z0-9-].*dpkg-(old|dist|new|tmp)$",
-                    REG_EXTENDED | REG_NOSUB)) != 0)
-            pt_regex = &excsre;
+        hierre = matcher_add(&name_matcher, "^_?([a-z0-9_.]+-)+[a-z0-9]+$",
+                    REG_EXTENDED);
+        excsre = matcher_add(&name_matcher,
+                    "^[a-z0-9-].*dpkg-(old|dist|new|tmp)$", REG_EXTENDED);
+        /* A basic RE in the original, but the same pattern as an ERE */
+        tradre = matcher_add(&name_matcher, "^[a-z0-9][a-z0-9-]*$",
+                    REG_EXTENDED);
 
-        else if ( (err = regcomp(&tradre, "^[a-z0-9][a-z0-9-]*$", REG_NOSUB))
-                    != 0)
-            pt_regex = &tradre;
-
-    } else if ( (err = regcomp(&classicalre, "^[a-zA-Z0-9_-]+$",
-                    REG_EXTENDED | REG_NOSUB)) != 0)
-        pt_regex = &classicalre;
-
-    if (err != 0) {
-        fprintf(stderr, "Unable to build regexp: %s", \
-                            regex_get_error(err, pt_regex));
-        exit(1);
-    }
+    } else
+        classicalre = matcher_add(&name_matcher, "^[a-zA-Z0-9_-]+$",
+                    REG_EXTENDED);
 }
 
 /*
@@ -619,19 +4149,638 @@ regex_get_error(int errcode, regex_t *compiled)
 }
 
 /*
- * Clean the compiled patterns according to the current regex_mode
+ * Clean the compiled patterns
  */
 static void
 regex_clean(void)
 {
-    if (regex_mode == RUNPARTS_ERE)
-        regfree(&customre);
+    matcher_free(&name_matcher);
+}
 
-    else if (regex_mode == RUNPARTS_LSBSYSINIT) {
-        regfree(&hierre);
-        regfree(&excsre);
-        regfree(&tradre);
+/*
+ * Filename matcher
+ *
+ * The filename patterns are compiled together into one Thompson NFA and
+ * matched by a DFA built lazily from it, so every name is checked in a
+ * single pass with a bounded amount of work per character, whatever the
+ * pattern.  Each pattern has one bit in the result.  Patterns using
+ * constructs the compiler does not handle (back references, GNU
+ * extensions such as \w, collating elements) keep using regexec().
+ *
+ * The supported subset of POSIX ERE: literals and \-escaped
+ * punctuation, ".", bracket expressions with ranges and [:class:]es,
+ * "^" and "$", grouping, "|", "*", "+", "?" and {m,n}.  Matching is done
+ * byte by byte, like regexec() in the C locale run-parts runs in.
+ */
 
-    } else
-        regfree(&classicalre);
+#define NFA_CHAR  0             /* consume a byte in set, go to out */
+#define NFA_SPLIT 1             /* go to both out and out1 */
+#define NFA_BOL   2             /* go to out at the start of the name */
+#define NFA_EOL   3             /* go to out at the end of the name */
+#define NFA_MATCH 4             /* pattern number out has matched */
+
+#define RE_EMPTY  0
+#define RE_SET    1
+#define RE_BOL    2
+#define RE_EOL    3
+#define RE_CAT    4
+#define RE_ALT    5
+#define RE_REPEAT 6
+
+#define RE_INFINITY -1
+#define RE_DUP_LIMIT 255
+
+struct re_node {
+    int             type;
+    struct re_node *left, *right;
+    int             min, max;
+    unsigned char   set[32];
+};
+
+struct re_parser {
+    const char     *p;
+    struct re_node *nodes;
+    int             count, size;
+};
+
+static int  matcher_nfa_node(struct matcher *m, int kind, int out, int out1);
+static void matcher_flush(struct matcher *m);
+
+static struct re_node *
+re_new(struct re_parser *rp, int type)
+{
+    struct re_node *node;
+
+    if (rp->count == rp->size)
+        return NULL;
+    node = &rp->nodes[rp->count++];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    return node;
+}
+
+static struct re_node *
+re_pair(struct re_parser *rp, int type, struct re_node *left,
+        struct re_node *right)
+{
+    struct re_node *node;
+
+    if (!left || !right || !(node = re_new(rp, type)))
+        return NULL;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+#define SET_ADD(set, c) ((set)[(unsigned char)(c) >> 3] |= \
+                         1 << ((unsigned char)(c) & 7))
+#define SET_HAS(set, c) ((set)[(unsigned char)(c) >> 3] & \
+                         (1 << ((unsigned char)(c) & 7)))
+
+/* Parse the inside of a bracket expression, after the "[" */
+/* Read a character of a bracket expression, which may be written as a
+   single character collating symbol such as "[.-.]".  Returns -1 for
+   anything else starting with "[", which is left to regexec(). */
+static int
+re_bracket_char(struct re_parser *rp)
+{
+    int c;
+
+    if (rp->p[0] != '[' ||
+        (rp->p[1] != '.' && rp->p[1] != '=' && rp->p[1] != ':'))
+        return (unsigned char)*rp->p++;
+    if (rp->p[1] != '.' || !rp->p[2] || rp->p[3] != '.' || rp->p[4] != ']')
+        return -1;
+    c = (unsigned char)rp->p[2];
+    rp->p += 5;
+    return c;
+}
+
+static struct re_node *
+re_bracket(struct re_parser *rp)
+{
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+        { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+        { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+        { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+    };
+    struct re_node *node;
+    int negate = 0, first = 1, c, last, i;
+    size_t len;
+
+    if (!(node = re_new(rp, RE_SET)))
+        return NULL;
+    if (*rp->p == '^') {
+        negate = 1;
+        rp->p++;
+    }
+
+    while (first || *rp->p != ']') {
+        first = 0;
+        if (!*rp->p)
+            return NULL;
+
+        if (rp->p[0] == '[' && rp->p[1] == ':') {
+            const char *end = strstr(rp->p + 2, ":]");
+
+            if (!end)
+                return NULL;
+            len = end - (rp->p + 2);
+            for (i = 0; i < (int)(sizeof(classes) / sizeof(classes[0])); i++)
+                if (strlen(classes[i].name) == len &&
+                    !strncmp(classes[i].name, rp->p + 2, len))
+                    break;
+            if (i == (int)(sizeof(classes) / sizeof(classes[0])))
+                return NULL;
+            for (c = 1; c < 256; c++)
+                if (classes[i].test(c))
+                    SET_ADD(node->set, c);
+            rp->p = end + 2;
+            continue;
+        }
+        if ((c = re_bracket_char(rp)) < 0)
+            return NULL;
+        last = c;
+        if (rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+            rp->p++;
+            if ((last = re_bracket_char(rp)) < 0 || last < c)
+                return NULL;
+        }
+        for (; c <= last; c++)
+            SET_ADD(node->set, c);
+    }
+    rp->p++;
+
+    if (negate)
+        for (i = 0; i < 32; i++)
+            node->set[i] = ~node->set[i];
+    node->set[0] &= ~1;         /* never NUL */
+    return node;
+}
+
+static struct re_node *re_alt(struct re_parser *rp);
+
+static struct re_node *
+re_atom(struct re_parser *rp)
+{
+    struct re_node *node;
+    int c = (unsigned char)*rp->p++;
+
+    switch (c) {
+    case '(':
+        node = re_alt(rp);
+        if (!node || *rp->p++ != ')')
+            return NULL;
+        return node;
+    case '[':
+        return re_bracket(rp);
+    case '^':
+        return re_new(rp, RE_BOL);
+    case '$':
+        return re_new(rp, RE_EOL);
+    case '.':
+        if (!(node = re_new(rp, RE_SET)))
+            return NULL;
+        memset(node->set, 0xff, sizeof(node->set));
+        node->set[0] &= ~1;
+        return node;
+    case '\\':
+        c = (unsigned char)*rp->p++;
+        /* \w, \b, \< and friends are GNU extensions */
+        if (!c || isalnum(c))
+            return NULL;
+        break;
+    case '*': case '+': case '?': case '{': case ')':
+        /* Undefined by POSIX where an atom is expected */
+        return NULL;
+    }
+
+    if (!(node = re_new(rp, RE_SET)))
+        return NULL;
+    SET_ADD(node->set, c);
+    return node;
+}
+
+/* Parse a {m,n} interval after the "{" */
+static int
+re_interval(struct re_parser *rp, int *min, int *max)
+{
+    char *end;
+
+    if (!isdigit((unsigned char)*rp->p))
+        return -1;
+    *min = *max = strtol(rp->p, &end, 10);
+    rp->p = end;
+    if (*rp->p == ',') {
+        rp->p++;
+        *max = RE_INFINITY;
+        if (isdigit((unsigned char)*rp->p)) {
+            *max = strtol(rp->p, &end, 10);
+            rp->p = end;
+        }
+    }
+    if (*rp->p++ != '}' || *min > RE_DUP_LIMIT ||
+        (*max != RE_INFINITY && (*max < *min || *max > RE_DUP_LIMIT)))
+        return -1;
+    return 0;
+}
+
+static struct re_node *
+re_repeat(struct re_parser *rp)
+{
+    struct re_node *node, *repeat;
+    int min, max;
+
+    node = re_atom(rp);
+    while (node && *rp->p && strchr("*+?{", *rp->p)) {
+        /* Repeated anchors are undefined by POSIX */
+        if (node->type == RE_BOL || node->type == RE_EOL)
+            return NULL;
+        switch (*rp->p++) {
+        case '*': min = 0; max = RE_INFINITY; break;
+        case '+': min = 1; max = RE_INFINITY; break;
+        case '?': min = 0; max = 1; break;
+        default:
+            if (re_interval(rp, &min, &max))
+                return NULL;
+        }
+        if (!(repeat = re_new(rp, RE_REPEAT)))
+            return NULL;
+        repeat->left = node;
+        repeat->min = min;
+        repeat->max = max;
+        node = repeat;
+    }
+    return node;
+}
+
+static struct re_node *
+re_concat(struct re_parser *rp)
+{
+    struct re_node *node = re_new(rp, RE_EMPTY);
+
+    while (node && *rp->p && *rp->p != '|' && *rp->p != ')')
+        node = re_pair(rp, RE_CAT, node, re_repeat(rp));
+    return node;
+}
+
+static struct re_node *
+re_alt(struct re_parser *rp)
+{
+    struct re_node *node = re_concat(rp);
+
+    while (node && *rp->p == '|') {
+        rp->p++;
+        node = re_pair(rp, RE_ALT, node, re_concat(rp));
+    }
+    return node;
+}
+
+/*
+ * Compile re into NFA nodes leading to next.  Returns the entry node,
+ * or -1 if the NFA grows too large.
+ */
+static int
+re_compile(struct matcher *m, struct re_node *re, int next)
+{
+    int node, loop, body, i;
+
+    if (next < 0)
+        return -1;
+
+    switch (re->type) {
+    case RE_EMPTY:
+        return next;
+    case RE_SET:
+        if ((node = matcher_nfa_node(m, NFA_CHAR, next, -1)) >= 0)
+            memcpy(m->nodes[node].set, re->set, sizeof(re->set));
+        return node;
+    case RE_BOL:
+        return matcher_nfa_node(m, NFA_BOL, next, -1);
+    case RE_EOL:
+        return matcher_nfa_node(m, NFA_EOL, next, -1);
+    case RE_CAT:
+        return re_compile(m, re->left, re_compile(m, re->right, next));
+    case RE_ALT:
+        body = re_compile(m, re->left, next);
+        return matcher_nfa_node(m, NFA_SPLIT, body,
+                                re_compile(m, re->right, next));
+    }
+
+    /* RE_REPEAT: the optional copies first, then the required ones */
+    node = next;
+    if (re->max == RE_INFINITY) {
+        /* out is patched to the loop body once that exists */
+        if ((loop = matcher_nfa_node(m, NFA_SPLIT, next, next)) < 0 ||
+            (body = re_compile(m, re->left, loop)) < 0)
+            return -1;
+        m->nodes[loop].out = body;
+        node = loop;
+    }
+    else {
+        for (i = re->min; i < re->max && node >= 0; i++)
+            node = matcher_nfa_node(m, NFA_SPLIT,
+                                    re_compile(m, re->left, node), next);
+    }
+    for (i = 0; i < re->min && node >= 0; i++)
+        node = re_compile(m, re->left, node);
+    return node;
+}
+
+static int
+matcher_nfa_node(struct matcher *m, int kind, int out, int out1)
+{
+    struct nfa_node *node;
+
+    if (out < 0 || (kind == NFA_SPLIT && out1 < 0) ||
+        m->nnodes == MATCHER_MAX_NODES)
+        return -1;
+    if (m->nnodes == m->nalloc) {
+        m->nalloc = m->nalloc ? m->nalloc * 2 : 64;
+        m->nodes = realloc(m->nodes, m->nalloc * sizeof(*m->nodes));
+        if (!m->nodes) {
+            error("failed to allocate memory for pattern: %s",
+                  strerror(errno));
+            exit(1);
+        }
+    }
+    node = &m->nodes[m->nnodes];
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    node->out = out;
+    node->out1 = out1;
+    return m->nnodes++;
+}
+
+/*
+ * Try to compile ere into the shared NFA as pattern number id.  Returns
+ * -1, leaving the NFA as it was, if the pattern is not supported.
+ */
+static int
+matcher_compile(struct matcher *m, const char *ere, int id)
+{
+    struct re_parser rp;
+    struct re_node *re;
+    int saved = m->nnodes, start = -1;
+
+    rp.p = ere;
+    rp.count = 0;
+    rp.size = 2 * strlen(ere) + 4;
+    if (!(rp.nodes = malloc(rp.size * sizeof(*rp.nodes)))) {
+        error("failed to allocate memory for pattern: %s", strerror(errno));
+        exit(1);
+    }
+
+    re = re_alt(&rp);
+    if (re && !*rp.p)
+        start = re_compile(m, re, matcher_nfa_node(m, NFA_MATCH, id, -1));
+    if (start >= 0 && m->start >= 0)
+        start = matcher_nfa_node(m, NFA_SPLIT, start, m->start);
+    free(rp.nodes);
+
+    if (start < 0) {
+        m->nnodes = saved;
+        return -1;
+    }
+    m->start = start;
+    matcher_flush(m);
+    return 0;
+}
+
+/*
+ * Add a pattern to the matcher and return its bit in the results of
+ * matcher_match().  The pattern is always compiled by regcomp() too, so
+ * invalid patterns are reported as before and unsupported ones can be
+ * matched by regexec().
+ */
+static uint32_t
+matcher_add(struct matcher *m, const char *pattern, int cflags)
+{
+    struct pattern *pat;
+    int err;
+
+    if (m->npatterns == MATCHER_MAX_PATTERNS) {
+        error("too many filename patterns");
+        exit(1);
+    }
+    if (!m->npatterns)
+        m->start = -1;
+    pat = &m->patterns[m->npatterns];
+
+    if ((err = regcomp(&pat->re, pattern, cflags | REG_NOSUB)) != 0) {
+        fprintf(stderr, "Unable to build regexp: %s", \
+                            regex_get_error(err, &pat->re));
+        exit(1);
+    }
+    pat->use_regexec = !(cflags & REG_EXTENDED) ||
+        matcher_compile(m, pattern, m->npatterns);
+
+    return (uint32_t)1 << m->npatterns++;
+}
+
+/* Add node and everything reachable from it without input to the set
+   being built in m->scratch. */
+static void
+matcher_closure(struct matcher *m, int node, int bol)
+{
+    int depth = 0;
+
+    m->stack[depth++] = node;
+    while (depth) {
+        node = m->stack[--depth];
+        if (m->mark[node] == m->generation)
+            continue;
+        m->mark[node] = m->generation;
+
+        switch (m->nodes[node].kind) {
+        case NFA_SPLIT:
+            m->stack[depth++] = m->nodes[node].out1;
+            m->stack[depth++] = m->nodes[node].out;
+            break;
+        case NFA_BOL:
+            if (bol)
+                m->stack[depth++] = m->nodes[node].out;
+            break;
+        default:
+            m->scratch[m->nscratch++] = node;
+        }
+    }
+}
+
+/* The patterns that have matched if the name ends in this set */
+static uint32_t
+matcher_accept(struct matcher *m, const int *nodes, int count)
+{
+    uint32_t accept = 0;
+    int i, depth, node;
+
+    m->generation++;
+    for (i = 0; i < count; i++) {
+        depth = 0;
+        m->stack[depth++] = nodes[i];
+        while (depth) {
+            node = m->stack[--depth];
+            if (m->mark[node] == m->generation)
+                continue;
+            m->mark[node] = m->generation;
+
+            switch (m->nodes[node].kind) {
+            case NFA_MATCH:
+                accept |= (uint32_t)1 << m->nodes[node].out;
+                break;
+            case NFA_SPLIT:
+                m->stack[depth++] = m->nodes[node].out1;
+                /* fall through */
+            case NFA_EOL:
+                m->stack[depth++] = m->nodes[node].out;
+                break;
+            }
+        }
+    }
+    return accept;
+}
+
+static int
+matcher_cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static void
+matcher_flush(struct matcher *m)
+{
+    int i;
+
+    for (i = 0; i < m->nstates; i++)
+        free(m->states[i].nodes);
+    m->nstates = 0;
+    m->initial = -1;
+    m->flushes++;
+}
+
+/* Find or create the DFA state for the set in m->scratch */
+static int
+matcher_state(struct matcher *m)
+{
+    struct dfa_state *state;
+    uint32_t hash = 2166136261u;
+    int i;
+
+    qsort(m->scratch, m->nscratch, sizeof(int), matcher_cmp_int);
+    for (i = 0; i < m->nscratch; i++)
+        hash = (hash ^ m->scratch[i]) * 16777619u;
+
+    for (i = 0; i < m->nstates; i++) {
+        state = &m->states[i];
+        if (state->hash == hash && state->count == m->nscratch &&
+            !memcmp(state->nodes, m->scratch, m->nscratch * sizeof(int)))
+            return i;
+    }
+
+    /* Starting over keeps the memory bounded; the work per character
+       stays linear in the size of the NFA. */
+    if (m->nstates == DFA_MAX_STATES)
+        matcher_flush(m);
+
+    state = &m->states[m->nstates];
+    state->hash = hash;
+    state->count = m->nscratch;
+    if (!(state->nodes = malloc((m->nscratch ? m->nscratch : 1) *
+                                sizeof(int)))) {
+        error("failed to allocate memory for pattern: %s", strerror(errno));
+        exit(1);
+    }
+    memcpy(state->nodes, m->scratch, m->nscratch * sizeof(int));
+    state->accept = matcher_accept(m, state->nodes, state->count);
+    for (i = 0; i < 256; i++)
+        state->next[i] = -1;
+    return m->nstates++;
+}
+
+/* Build the transition from state on byte c */
+static int
+matcher_step(struct matcher *m, int from, unsigned char c)
+{
+    struct dfa_state *state = &m->states[from];
+    int i, node, to, flushes = m->flushes;
+
+    m->generation++;
+    m->nscratch = 0;
+    for (i = 0; i < state->count; i++) {
+        node = state->nodes[i];
+        if (m->nodes[node].kind == NFA_CHAR && SET_HAS(m->nodes[node].set, c))
+            matcher_closure(m, m->nodes[node].out, 0);
+        else if (m->nodes[node].kind == NFA_MATCH)
+            /* Once matched, a pattern stays matched */
+            matcher_closure(m, node, 0);
+    }
+    /* A match may start anywhere in the name */
+    matcher_closure(m, m->start, 0);
+
+    to = matcher_state(m);
+    if (m->flushes == flushes)
+        m->states[from].next[c] = to;
+    return to;
+}
+
+/* Return the bits of all patterns matching name */
+static uint32_t
+matcher_match(struct matcher *m, const char *name)
+{
+    const unsigned char *p;
+    uint32_t matched = 0;
+    int i, state, next;
+
+    for (i = 0; i < m->npatterns; i++)
+        if (m->patterns[i].use_regexec &&
+            !regexec(&m->patterns[i].re, name, 0, NULL, 0))
+            matched |= (uint32_t)1 << i;
+
+    if (m->start < 0)
+        return matched;
+
+    if (!m->states) {
+        m->states = malloc(DFA_MAX_STATES * sizeof(*m->states));
+        m->mark = calloc(m->nnodes, sizeof(*m->mark));
+        m->stack = malloc((2 * m->nnodes + 1) * sizeof(*m->stack));
+        m->scratch = malloc(m->nnodes * sizeof(*m->scratch));
+        if (!m->states || !m->mark || !m->stack || !m->scratch) {
+            error("failed to allocate memory for pattern: %s",
+                  strerror(errno));
+            exit(1);
+        }
+    }
+    if (m->initial < 0) {
+        m->generation++;
+        m->nscratch = 0;
+        matcher_closure(m, m->start, 1);
+        m->initial = matcher_state(m);
+    }
+
+    state = m->initial;
+    for (p = (const unsigned char *)name; *p; p++) {
+        next = m->states[state].next[*p];
+        state = next >= 0 ? next : matcher_step(m, state, *p);
+    }
+    return matched | m->states[state].accept;
+}
+
+static void
+matcher_free(struct matcher *m)
+{
+    int i;
+
+    matcher_flush(m);
+    for (i = 0; i < m->npatterns; i++)
+        regfree(&m->patterns[i].re);
+    free(m->states);
+    free(m->mark);
+    free(m->stack);
+    free(m->scratch);
+    free(m->nodes);
+    memset(m, 0, sizeof(*m));
 }
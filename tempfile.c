@@ -9,12 +9,102 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif /* HAVE_SYS_XATTR_H */
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif /* HAVE_SYS_RANDOM_H */
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#include <sys/statvfs.h>
+#endif /* HAVE_SYS_VFS_H */
+
+/* Filesystems kept in memory, which --auto-dir prefers for small files */
+#ifndef TMPFS_MAGIC
+#define TMPFS_MAGIC 0x01021994
+#endif
+#ifndef RAMFS_MAGIC
+#define RAMFS_MAGIC 0x858458f6
+#endif
+
+/* Length of the random part of a name, and the characters used in it,
+   as in mkstemp(3) */
+#define RANDOM_CHARS 6
+static const char letters[] =
+  "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+/* Names tried before giving up */
+#define ATTEMPTS (62 * 62 * 62)
+
+/* Most subdirectories --shard spreads files over, named 00 to ff, in
+   a directory of their own per user, so that no user can take the
+   shard names from another.  Where someone has taken the name of that
+   directory itself, files are not sharded. */
+#define MAX_SHARDS 256
+#define SHARD_PARENT "tempfile-%lu"
+
+/* Extended attribute --tag marks files with, for --reap to find */
+#define TAG_NAME "user.tempfile"
+
+/* Directory entries --reap removes at a time */
+#define REAP_BATCH 256
+
+/* What --reap removes, and how it reports it */
+struct reap {
+  const char *pfx, *sfx;
+  size_t pfxlen, sfxlen;
+  time_t cutoff;
+  unsigned long shards;		/* whether to reap shards, not how many */
+  char term;
+  int status;
+};
+
+/* Directory entry as returned by getdents64(2) */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
 char *progname;
+int tag = 0;
 
 void usage(int);
 void syserror(const char *);
 int parsemode(const char *, mode_t *);
+int parsesize(const char *, off_t *);
+int parseage(const char *, time_t *);
+int direxists(const char *);
+const char *choose_dir(const char *);
+const char *auto_dir(const char *, off_t);
+void random_name(char *);
+int preallocate(int, off_t);
+int tag_file(int);
+int create_file(int, char *, char *, mode_t, off_t);
+int create_dir(int, char *, char *, mode_t);
+unsigned int name_hash(const char *);
+int open_shard(int, const char *, int);
+int is_tempname(const char *, const struct reap *);
+int is_tagged(int, const char *, const struct stat *);
+void reap_batch(int, const char *, char (*)[256], int, struct reap *);
+void reap_dir(int, const char *, struct reap *, int);
+void remove_files(int, const char *, size_t, unsigned long, int);
+
+/* Long options without a short equivalent */
+#define OPT_COUNT 256
+#define OPT_SIZE 257
+#define OPT_AUTO_DIR 258
+#define OPT_SHARD 259
+#define OPT_REAP 260
+#define OPT_OLDER_THAN 261
 
 void
 usage (int status)
@@ -25,10 +115,19 @@ usage (int status)
     printf("Usage: %s [OPTION]\n\n"
 "Create a temporary file in a safe manner.\n\n"
 "-d, --directory=DIR  place temporary file in DIR\n"
-"-m, --mode=MODE      open with MODE instead of 0600\n"
-"-n, --name=FILE      use FILE instead of tempnam(3)\n"
+"-m, --mode=MODE      open with MODE instead of 0600 (0700 for directories)\n"
+"-n, --name=FILE      use FILE instead of a generated name\n"
 "-p, --prefix=STRING  set temporary file's prefix to STRING\n"
 "-s, --suffix=STRING  set temporary file's suffix to STRING\n"
+"    --count=N        create N files and print one name per line\n"
+"    --null           end each name with a null character, not newline\n"
+"    --directory-mode create a directory instead of a file\n"
+"    --size=BYTES     preallocate BYTES, which may end in K, M, G or T\n"
+"    --auto-dir[=SIZE] choose the directory best suited to SIZE bytes\n"
+"    --shard=K        spread files over K subdirectories of the directory\n"
+"    --tag            mark files with the " TAG_NAME " extended attribute\n"
+"    --reap=DIR       remove files left by tempfile in DIR instead\n"
+"    --older-than=AGE with --reap, only those unchanged for AGE (s, m, h, d, w)\n"
 "    --help           display this help and exit\n"
 "    --version        output version information and exit\n", progname);
   exit(status);
@@ -56,18 +155,526 @@ parsemode (const char *in, mode_t *out)
 }
 
 
+/* Parse a size in bytes, optionally followed by K, M, G or T for
+   powers of 1024 */
+int
+parsesize (const char *in, off_t *out)
+{
+  static const char units[] = "KMGT";
+  const char *unit;
+  char *endptr;
+  unsigned long long size;
+  int shift = 0;
+
+  errno = 0;
+  size = strtoull(in, &endptr, 10);
+  if (errno || endptr == in || *in == '-')
+    return 1;
+  if (*endptr) {
+    if (endptr[1] || !(unit = strchr(units, *endptr)))
+      return 1;
+    shift = 10 * (unit - units + 1);
+  }
+  /* off_t is signed, so the largest size is below 2^63 */
+  if (size > (~0ULL >> 1) >> shift)
+    return 1;
+  *out = (off_t)(size << shift);
+  return 0;
+}
+
+
+/* Parse an age in seconds, optionally followed by s, m, h, d or w */
+int
+parseage (const char *in, time_t *out)
+{
+  static const char units[] = "smhdw";
+  static const long seconds[] = { 1, 60, 3600, 86400, 604800 };
+  const char *unit;
+  char *endptr;
+  unsigned long age;
+  long mult = 1;
+
+  errno = 0;
+  age = strtoul(in, &endptr, 10);
+  if (errno || endptr == in || *in == '-')
+    return 1;
+  if (*endptr) {
+    if (endptr[1] || !(unit = strchr(units, *endptr)))
+      return 1;
+    mult = seconds[unit - units];
+  }
+  if (age > (unsigned long)LONG_MAX / mult)
+    return 1;
+  *out = (time_t)(age * mult);
+  return 0;
+}
+
+
+int
+direxists (const char *dir)
+{
+  struct stat st;
+  return !stat(dir, &st) && S_ISDIR(st.st_mode);
+}
+
+
+/* Pick the directory the way tempnam(3) does */
+const char *
+choose_dir (const char *dir)
+{
+  const char *tmpdir = getenv("TMPDIR");
+
+  if (tmpdir && direxists(tmpdir))
+    return tmpdir;
+  if (dir && direxists(dir))
+    return dir;
+  if (direxists(P_tmpdir))
+    return P_tmpdir;
+  if (strcmp(P_tmpdir, "/tmp") && direxists("/tmp"))
+    return "/tmp";
+  errno = ENOENT;
+  return NULL;
+}
+
+
+/* Pick the directory for a file expected to grow to size bytes from
+   $TMPDIR, dir, /dev/shm, /run/user/UID, /tmp and /var/tmp.  The first
+   memory-backed one where size is at most a quarter of the free space
+   is used, so small files stay off the disk without crowding out
+   memory, and failing that the first one on disk with room for size.
+   Read-only and unwritable directories are skipped.  If none fits, the
+   directory is chosen as usual. */
+const char *
+auto_dir (const char *dir, off_t size)
+{
+#ifdef HAVE_SYS_VFS_H
+  char rundir[32];
+  const char *candidates[6];
+  const char *disk = NULL;
+  struct statfs sfs;
+  unsigned long long avail;
+  int i, n = 0, ram;
+
+  if ((candidates[n] = getenv("TMPDIR")) && *candidates[n])
+    n++;
+  if ((candidates[n] = dir))
+    n++;
+  candidates[n++] = "/dev/shm";
+  snprintf(rundir, sizeof(rundir), "/run/user/%lu", (unsigned long)getuid());
+  candidates[n++] = rundir;
+  candidates[n++] = "/tmp";
+  candidates[n++] = "/var/tmp";
+
+  for (i = 0; i < n; i++) {
+    if (!direxists(candidates[i]) ||
+	faccessat(AT_FDCWD, candidates[i], W_OK | X_OK, AT_EACCESS) ||
+	statfs(candidates[i], &sfs) || (sfs.f_flags & ST_RDONLY))
+      continue;
+    avail = (unsigned long long)sfs.f_bavail * sfs.f_bsize;
+    ram = sfs.f_type == TMPFS_MAGIC || sfs.f_type == RAMFS_MAGIC;
+    if (ram && (unsigned long long)size <= avail / 4)
+      return candidates[i];
+    if (!ram && !disk && (unsigned long long)size <= avail)
+      disk = candidates[i];
+  }
+  if (disk)
+    return disk;
+#endif /* HAVE_SYS_VFS_H */
+  return choose_dir(dir);
+}
+
+
+/* Fill in the random part of a name.  Random bytes are fetched in
+   bulk from getrandom(2), or /dev/urandom on systems without it. */
+void
+random_name (char *x)
+{
+  static unsigned char pool[256];
+  static size_t avail = 0;
+  ssize_t c;
+  int i, j, fd;
+
+  /* 62 * 4 = 248, so bytes below that map onto letters without bias */
+  for (i = 0; i < RANDOM_CHARS; ) {
+    if (!avail) {
+      c = -1;
+#ifdef HAVE_GETRANDOM
+      while ((c = getrandom(pool, sizeof(pool), 0)) < 0 && errno == EINTR)
+	;
+#endif /* HAVE_GETRANDOM */
+      if (c < (ssize_t)sizeof(pool)) {
+	if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0 ||
+	    read(fd, pool, sizeof(pool)) != sizeof(pool)) {
+	  /* Predictable, but O_EXCL and linkat() keep this safe */
+	  for (j = 0; j < (int)sizeof(pool); j++)
+	    pool[j] = (rand() ^ getpid() ^ time(NULL) ^ j) & 0xff;
+	}
+	if (fd >= 0)
+	  close(fd);
+      }
+      avail = sizeof(pool);
+    }
+    c = pool[--avail];
+    if (c < 248)
+      x[i++] = letters[c % 62];
+  }
+}
+
+
+/* Reserve size bytes of disk space for fd.  The space is allocated
+   past the end of the file where the filesystem allows it, so the file
+   stays empty until written; posix_fallocate(3) extends it instead. */
+int
+preallocate (int fd, off_t size)
+{
+  if (!size)
+    return 0;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  if (!fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size))
+    return 0;
+  if (errno != EOPNOTSUPP && errno != ENOSYS)
+    return -1;
+#endif /* HAVE_FALLOCATE && FALLOC_FL_KEEP_SIZE */
+  if ((errno = posix_fallocate(fd, 0, size)))
+    return -1;
+  return 0;
+}
+
+
+/* Mark fd with the --tag attribute, if asked to.  Filesystems without
+   user extended attributes leave files untagged, which only means
+   --reap --tag passes them over. */
+int
+tag_file (int fd)
+{
+  if (!tag)
+    return 0;
+#ifdef HAVE_SYS_XATTR_H
+  if (!fsetxattr(fd, TAG_NAME, "1", 1, 0) || errno == ENOTSUP)
+    return 0;
+  return -1;
+#else
+  return 0;
+#endif /* HAVE_SYS_XATTR_H */
+}
+
+
+/* Create a file named base in dfd, with the RANDOM_CHARS at x, which
+   the caller fills in, redrawn after each collision, and preallocate
+   size bytes for it.  The file is
+   created unnamed with O_TMPFILE and then linked in, which fails
+   instead of replacing an existing file, so no name is ever probed
+   first, and a file whose space cannot be had is never seen.  Where
+   O_TMPFILE or /proc is missing, names are tried with O_EXCL as
+   mkstemps(3) does. */
+int
+create_file (int dfd, char *base, char *x, mode_t mode, off_t size)
+{
+  int fd, tries;
+#ifdef O_TMPFILE
+  char path[32];
+
+  if ((fd = openat(dfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, mode)) >= 0) {
+    if (preallocate(fd, size) || tag_file(fd)) {
+      tries = errno;
+      close(fd);
+      errno = tries;
+      return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    for (tries = 0; tries < ATTEMPTS; tries++, random_name(x)) {
+      if (!linkat(AT_FDCWD, path, dfd, base, AT_SYMLINK_FOLLOW))
+	return fd;
+      if (errno != EEXIST)
+	break;
+    }
+    close(fd);
+    if (errno == EEXIST)
+      return -1;
+  }
+  else if (errno != EISDIR && errno != EOPNOTSUPP && errno != EINVAL)
+    return -1;
+#endif /* O_TMPFILE */
+
+  for (tries = 0; tries < ATTEMPTS; tries++, random_name(x)) {
+    if ((fd = openat(dfd, base, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		     mode)) >= 0) {
+      if (preallocate(fd, size) || tag_file(fd)) {
+	tries = errno;
+	close(fd);
+	unlinkat(dfd, base, 0);
+	errno = tries;
+	return -1;
+      }
+      return fd;
+    }
+    if (errno != EEXIST)
+      return -1;
+  }
+  return -1;
+}
+
+
+/* Create a directory named base in dfd, as mkdtemp(3) does */
+int
+create_dir (int dfd, char *base, char *x, mode_t mode)
+{
+  int tries;
+
+  for (tries = 0; tries < ATTEMPTS; tries++, random_name(x)) {
+    if (!mkdirat(dfd, base, mode))
+      return 0;
+    if (errno != EEXIST)
+      return -1;
+  }
+  return -1;
+}
+
+
+/* FNV-1a hash of the random part of a name, to pick its shard */
+unsigned int
+name_hash (const char *x)
+{
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i = 0; i < RANDOM_CHARS; i++)
+    h = (h ^ (unsigned char)x[i]) * 16777619u;
+  return h;
+}
+
+
+/* Open the shard directory name in dfd, creating it with mode 0700 if
+   need be and create is set.  One that already exists must be ours and
+   closed to everyone else, or whoever can replace its entries could
+   redirect our files. */
+int
+open_shard (int dfd, const char *name, int create)
+{
+  struct stat st;
+  int fd;
+
+  if (create && mkdirat(dfd, name, 0700) && errno != EEXIST)
+    return -1;
+  if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		   O_CLOEXEC)) < 0)
+    return -1;
+  if (fstat(fd, &st) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+    close(fd);
+    errno = EPERM;
+    return -1;
+  }
+  return fd;
+}
+
+
+/* Whether name is one tempfile would generate with r's prefix and
+   suffix */
+int
+is_tempname (const char *name, const struct reap *r)
+{
+  size_t i;
+
+  if (strlen(name) != r->pfxlen + RANDOM_CHARS + r->sfxlen ||
+      strncmp(name, r->pfx, r->pfxlen) ||
+      strcmp(name + r->pfxlen + RANDOM_CHARS, r->sfx))
+    return 0;
+  for (i = r->pfxlen; i < r->pfxlen + RANDOM_CHARS; i++)
+    if (!strchr(letters, name[i]))
+      return 0;
+  return 1;
+}
+
+
+/* Whether the entry name in dfd, which fstatat() found to be st, carries
+   the --tag attribute.  The entry is opened relative to dfd, like
+   everything else --reap does, and must still be the file looked at. */
+int
+is_tagged (int dfd, const char *name, const struct stat *st)
+{
+#ifdef HAVE_SYS_XATTR_H
+  struct stat fst;
+  int fd, r;
+
+  if ((fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK |
+		   O_NOCTTY | O_CLOEXEC)) < 0)
+    return 0;
+  r = !fstat(fd, &fst) && fst.st_dev == st->st_dev &&
+    fst.st_ino == st->st_ino && fgetxattr(fd, TAG_NAME, NULL, 0) >= 0;
+  close(fd);
+  return r;
+#else
+  return 0;
+#endif /* HAVE_SYS_XATTR_H */
+}
+
+
+/* Unlink the n names in batch from dfd, whose path is dir, and print
+   those removed.  One that is already gone is no error. */
+void
+reap_batch (int dfd, const char *dir, char (*batch)[256], int n,
+	    struct reap *r)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (!unlinkat(dfd, batch[i], 0))
+      printf("%s/%s%c", dir, batch[i], r->term);
+    else if (errno != ENOENT) {
+      fprintf(stderr, "%s/%s: %s\n", dir, batch[i], strerror(errno));
+      r->status = 1;
+    }
+  }
+}
+
+
+/* Remove the regular files in dfd, whose path is dir, that tempfile
+   left there and that have not changed since r->cutoff.  Entries are
+   read with getdents64(2) and looked at with fstatat(2) relative to
+   dfd, so nothing is resolved twice and symbolic links are never
+   followed, and each buffer's worth of matches is unlinked together.
+   At depth 0 every --shard subdirectory of the user is reaped as well,
+   whatever number of shards it was created with, and removed if that
+   leaves it empty. */
+void
+reap_dir (int dfd, const char *dir, struct reap *r, int depth)
+{
+  static const char hex[] = "0123456789abcdef";
+  static char buf[32768];
+  char batch[REAP_BATCH][256], path[PATH_MAX], subs[MAX_SHARDS][3];
+  char parent[32];
+  struct linux_dirent64 *d;
+  struct stat st;
+  uid_t uid = geteuid();
+  long n, off;
+  int nbatch, nsubs, sfd, pfd, i;
+
+  for (;;) {
+#ifdef SYS_getdents64
+    n = syscall(SYS_getdents64, dfd, buf, sizeof(buf));
+#else
+    n = -1;
+    errno = ENOSYS;
+#endif /* SYS_getdents64 */
+    if (n <= 0)
+      break;
+    nbatch = 0;
+    for (off = 0; off < n; off += d->d_reclen) {
+      d = (struct linux_dirent64 *)(buf + off);
+      if ((d->d_type != DT_REG && d->d_type != DT_UNKNOWN) ||
+	  (!tag && !is_tempname(d->d_name, r)) ||
+	  fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+	  !S_ISREG(st.st_mode) || (uid && st.st_uid != uid) ||
+	  st.st_mtime > r->cutoff || st.st_ctime > r->cutoff)
+	continue;
+      if (tag && !is_tagged(dfd, d->d_name, &st))
+	continue;
+      strcpy(batch[nbatch++], d->d_name);
+      if (nbatch == REAP_BATCH) {
+	reap_batch(dfd, dir, batch, nbatch, r);
+	nbatch = 0;
+      }
+    }
+    reap_batch(dfd, dir, batch, nbatch, r);
+  }
+  if (n < 0) {
+    perror(dir);
+    r->status = 1;
+  }
+
+  if (depth || !r->shards)
+    return;
+  snprintf(parent, sizeof(parent), SHARD_PARENT, (unsigned long)uid);
+  if ((pfd = open_shard(dfd, parent, 0)) < 0) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "%s/%s: %s\n", dir, parent, strerror(errno));
+      r->status = 1;
+    }
+    return;
+  }
+
+  /* Collect the shard names first, as reaping them reuses buf */
+  nsubs = 0;
+#ifdef SYS_getdents64
+  while ((n = syscall(SYS_getdents64, pfd, buf, sizeof(buf))) > 0)
+    for (off = 0; off < n; off += d->d_reclen) {
+      d = (struct linux_dirent64 *)(buf + off);
+      if (strlen(d->d_name) == 2 && strchr(hex, d->d_name[0]) &&
+	  strchr(hex, d->d_name[1]) && nsubs < MAX_SHARDS)
+	strcpy(subs[nsubs++], d->d_name);
+    }
+#endif /* SYS_getdents64 */
+
+  for (i = 0; i < nsubs; i++) {
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, parent, subs[i]);
+    if ((sfd = open_shard(pfd, subs[i], 0)) < 0) {
+      if (errno != ENOENT) {
+	perror(path);
+	r->status = 1;
+      }
+      continue;
+    }
+    reap_dir(sfd, path, r, 1);
+    close(sfd);
+    /* A tempfile --shard that had it open creates it again */
+    if (unlinkat(pfd, subs[i], AT_REMOVEDIR) && errno != ENOTEMPTY &&
+	errno != EEXIST && errno != ENOENT) {
+      perror(path);
+      r->status = 1;
+    }
+  }
+  close(pfd);
+}
+
+
+/* Unlink the first n of the names stored len bytes apart in names,
+   keeping errno for the error that led here.  flags is AT_REMOVEDIR
+   for directories. */
+void
+remove_files (int dfd, const char *names, size_t len, unsigned long n,
+	      int flags)
+{
+  int saved = errno;
+
+  while (n--)
+    unlinkat(dfd, names + n * len, flags);
+  errno = saved;
+}
+
+
 int
 main (int argc, char **argv)
 {
-  char *name=0, *dir=0, *pfx=0, *sfx=0, *filename=0;
+  char *name=0, *dir=0, *pfx=0, *sfx=0, *filename=0, *base, *x;
+  char *names, *end, *rel, *shard, sub[3], *reapdir = 0;
+  char shardpath[40] = "";
+  const char *tmpdir;
   mode_t mode = 0600;
-  int fd, optc;
+  off_t size = 0;
+  size_t dirlen, pfxlen, len;
+  unsigned long count = 1, shards = 0, i;
+  unsigned int bucket = 0;
+  int shardfd[MAX_SHARDS];
+  int sfd, pfd = -1, retried;
+  off_t autosize = -1;
+  time_t age = -1;
+  struct reap r;
+  int fd = -1, dfd, optc, nul = 0, dirmode = 0, modeset = 0, autodir = 0;
   struct option long_options[] = {
     {"prefix", required_argument, 0, 'p'},
     {"suffix", required_argument, 0, 's'},
     {"directory", required_argument, 0, 'd'},
     {"mode", required_argument, 0, 'm'},
     {"name", required_argument, 0, 'n'},
+    {"count", required_argument, 0, OPT_COUNT},
+    {"null", no_argument, &nul, 1},
+    {"directory-mode", no_argument, &dirmode, 1},
+    {"size", required_argument, 0, OPT_SIZE},
+    {"auto-dir", optional_argument, 0, OPT_AUTO_DIR},
+    {"shard", required_argument, 0, OPT_SHARD},
+    {"tag", no_argument, &tag, 1},
+    {"reap", required_argument, 0, OPT_REAP},
+    {"older-than", required_argument, 0, OPT_OLDER_THAN},
     {"help", no_argument, 0, 'h'},
     {"version", no_argument, 0, 'v'},
     {0, 0, 0, 0}
@@ -93,12 +700,53 @@ main (int argc, char **argv)
 	fprintf(stderr, "Invalid mode `%s'.  Mode must be octal.\n", optarg);
 	usage(1);
       }
+      modeset = 1;
       break;
     case 'n':
       /* strdup because it is freed later on */
       if((name = strdup(optarg)) == NULL)
         syserror("strdup");
       break;
+    case OPT_COUNT:
+      errno = 0;
+      count = strtoul(optarg, &end, 10);
+      if (errno || end == optarg || *end || !count || optarg[0] == '-') {
+	fprintf(stderr, "Invalid count `%s'.\n", optarg);
+	usage(1);
+      }
+      break;
+    case OPT_SIZE:
+      if (parsesize(optarg, &size)) {
+	fprintf(stderr, "Invalid size `%s'.\n", optarg);
+	usage(1);
+      }
+      break;
+    case OPT_SHARD:
+      errno = 0;
+      shards = strtoul(optarg, &end, 10);
+      if (errno || end == optarg || *end || !shards || shards > MAX_SHARDS ||
+	  optarg[0] == '-') {
+	fprintf(stderr, "Invalid shard count `%s'.  It must be 1 to %d.\n",
+		optarg, MAX_SHARDS);
+	usage(1);
+      }
+      break;
+    case OPT_REAP:
+      reapdir = optarg;
+      break;
+    case OPT_OLDER_THAN:
+      if (parseage(optarg, &age)) {
+	fprintf(stderr, "Invalid age `%s'.\n", optarg);
+	usage(1);
+      }
+      break;
+    case OPT_AUTO_DIR:
+      autodir = 1;
+      if (optarg && parsesize(optarg, &autosize)) {
+	fprintf(stderr, "Invalid size `%s'.\n", optarg);
+	usage(1);
+      }
+      break;
     case 'h':
       usage(0);
     case 'v':
@@ -109,44 +757,171 @@ main (int argc, char **argv)
     }
   }
 
+  if (reapdir || age >= 0) {
+    if (!reapdir || age < 0) {
+      fprintf(stderr, "--reap and --older-than go together.\n");
+      usage(1);
+    }
+    if (name) {
+      fprintf(stderr, "--reap cannot be used with --name.\n");
+      usage(1);
+    }
+    /* Match the names the same options would create */
+    r.pfx = pfx && *pfx ? pfx : "file";
+    r.pfxlen = strlen(r.pfx) < 5 ? strlen(r.pfx) : 5;
+    r.sfx = sfx ? sfx : "";
+    r.sfxlen = strlen(r.sfx);
+    r.cutoff = time(NULL) - age;
+    r.shards = shards;
+    r.term = nul ? '\0' : '\n';
+    r.status = 0;
+
+    dirlen = strlen(reapdir);
+    while (dirlen > 1 && reapdir[dirlen - 1] == '/')
+      reapdir[--dirlen] = '\0';
+    if ((dfd = open(reapdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+      syserror(reapdir);
+    reap_dir(dfd, reapdir, &r, 0);
+    close(dfd);
+    if (fflush(stdout))
+      syserror("write");
+    exit(r.status);
+  }
+
+  if (dirmode) {
+    if (size) {
+      fprintf(stderr, "--size cannot be used with --directory-mode.\n");
+      usage(1);
+    }
+    if (!modeset)
+      mode = 0700;
+  }
+
   if (name) {
-    if ((fd = open(name, O_RDWR | O_CREAT | O_EXCL, mode)) < 0)
-      syserror("open");
-    filename = name;
+    if (count != 1 || shards) {
+      fprintf(stderr, "--name creates a single file.\n");
+      usage(1);
+    }
+    if (dirmode) {
+      if (mkdir(name, mode))
+	syserror("mkdir");
+    }
+    else {
+      if ((fd = open(name, O_RDWR | O_CREAT | O_EXCL, mode)) < 0)
+	syserror("open");
+      if (preallocate(fd, size) || tag_file(fd)) {
+	unlink(name);
+	syserror(name);
+      }
+      if (close(fd))
+	syserror("close");
+    }
+    printf("%s%c", name, nul ? '\0' : '\n');
   }
   else {
-    for (;;) {
-      if (!(name = tempnam(dir, pfx)))
-	syserror("tempnam");
-      if(sfx) {
-        char *namesfx;
-        if (!(namesfx = (char *)malloc(strlen(name) + strlen(sfx) + 1)))
-          syserror("malloc");
-        strcpy(namesfx, name);
-        strcat(namesfx, sfx);
-        filename = namesfx;
+    /* Without a size of its own, --auto-dir plans for --size */
+    if (autodir)
+      tmpdir = auto_dir(dir, autosize >= 0 ? autosize : size);
+    else
+      tmpdir = choose_dir(dir);
+    if (!tmpdir)
+      syserror("tempfile");
+    if ((dfd = open(tmpdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+      syserror("open");
+
+    /* DIR/PFXXXXXXXSFX, with up to five characters of prefix, or
+       DIR/tempfile-UID/NN/PFXXXXXXXSFX when sharded */
+    if (!pfx || !*pfx)
+      pfx = "file";
+    if (!sfx)
+      sfx = "";
+    dirlen = strlen(tmpdir);
+    while (dirlen > 1 && tmpdir[dirlen - 1] == '/')
+      dirlen--;
+    pfxlen = strlen(pfx) < 5 ? strlen(pfx) : 5;
+    if (shards) {
+      snprintf(shardpath, sizeof(shardpath), SHARD_PARENT,
+	       (unsigned long)geteuid());
+      /* Anyone can take the parent's name first in a shared directory.
+	 The files then go in the directory itself, which is as safe, if
+	 not as quick. */
+      if ((pfd = open_shard(dfd, shardpath, 1)) < 0) {
+	fprintf(stderr, "%s: %.*s/%s: %s; not sharding\n", progname,
+		(int)dirlen, tmpdir, shardpath, strerror(errno));
+	shards = 0;
+	shardpath[0] = '\0';
       }
       else
-        filename = name;
-
-      if ((fd = open(filename, O_RDWR | O_CREAT | O_EXCL, mode)) < 0) {
-	if (errno == EEXIST) {
-          if(name != filename)
-            free(name);
-	  free(filename);
-	  continue;
+	strcat(shardpath, "/00/");
+    }
+    if (!(filename = malloc(dirlen + strlen(shardpath) + pfxlen +
+			    RANDOM_CHARS + strlen(sfx) + 2)))
+      syserror("malloc");
+    sprintf(filename, "%.*s/%s%.*sXXXXXX%s", (int)dirlen, tmpdir,
+	    shardpath, (int)pfxlen, pfx, sfx);
+    rel = filename + dirlen + 1;
+    base = rel + strlen(shardpath);
+    shard = base - 3;
+    x = base + pfxlen;
+    for (i = 0; i < MAX_SHARDS; i++)
+      shardfd[i] = -1;
+
+    /* All the names share one directory and length, so only the part
+       below it is kept, to remove them again on failure and to print
+       them once every file exists */
+    len = strlen(rel) + 1;
+    if (count > (size_t)-1 / len || !(names = malloc(count * len)))
+      syserror("malloc");
+    for (i = 0; i < count; i++) {
+      random_name(x);
+      retried = 0;
+    again:
+      sfd = dfd;
+      if (shards) {
+	bucket = name_hash(x) % shards;
+	snprintf(sub, sizeof(sub), "%02x", bucket);
+	memcpy(shard, sub, 2);
+	if (shardfd[bucket] < 0 &&
+	    (shardfd[bucket] = open_shard(pfd, sub, 1)) < 0) {
+	  remove_files(dfd, names, len, i, dirmode ? AT_REMOVEDIR : 0);
+	  shard[2] = '\0';
+	  syserror(filename);
 	}
-	syserror("open");
+	sfd = shardfd[bucket];
+      }
+      if (dirmode ? create_dir(sfd, base, x, mode) :
+	  (fd = create_file(sfd, base, x, mode, size)) < 0) {
+	/* --reap removed the shard after we opened it; make it again */
+	if (shards && errno == ENOENT && !retried) {
+	  close(shardfd[bucket]);
+	  shardfd[bucket] = -1;
+	  retried = 1;
+	  goto again;
+	}
+	remove_files(dfd, names, len, i, dirmode ? AT_REMOVEDIR : 0);
+	syserror(dirmode ? "mkdir" : "open");
+      }
+      memcpy(names + i * len, rel, len);
+      if (dirmode)
+	continue;
+      if (close(fd)) {
+	remove_files(dfd, names, len, i + 1, 0);
+	syserror("close");
       }
-      break;
     }
+    close(dfd);
+
+    for (i = 0; i < count; i++) {
+      memcpy(rel, names + i * len, len);
+      fputs(filename, stdout);
+      putchar(nul ? '\0' : '\n');
+    }
+    free(names);
   }
-  
-  if (close(fd))
-    syserror("close");
-  puts(filename);
-  if(name != filename)
-    free(name);
+
+  if (fflush(stdout))
+    syserror("write");
+  free(name);
   free(filename);
   exit(0);
 }
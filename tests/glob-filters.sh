@@ -0,0 +1,47 @@
+#!/bin/sh
+# Check that --include-glob matches like fnmatch(3) with FNM_PERIOD:
+# bracket expressions with character classes and special characters,
+# and no wildcard or bracket matching a leading dot.
+
+runparts=${RUN_PARTS:-./run-parts}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+for name in a b1 1 '\' ']' - '^' .hidden visible; do
+    : > "$dir/$name"
+done
+
+status=0
+
+# expect PATTERN NAMES...: the names --include-glob=PATTERN lists
+expect() {
+    pattern=$1
+    shift
+    got=$("$runparts" --list --include-glob="$pattern" "$dir" |
+	  sed "s|^$dir/||" | tr '\n' ' ')
+    want=
+    if [ $# -gt 0 ]; then
+	want=$(printf '%s\n' "$@" | LC_ALL=C sort | tr '\n' ' ')
+    fi
+    if [ "$got" != "$want" ]; then
+	echo "$0: --include-glob='$pattern' listed '$got', expected '$want'" >&2
+	status=1
+    fi
+}
+
+expect '[[:alpha:]]' a
+expect '[[:alpha:]][[:digit:]]' b1
+expect '[![:alnum:]]' '\' ']' - '^'
+expect '[]]' ']'
+expect '[a-]' a -
+expect '[\]]' ']'
+expect '[\^]' '^'
+expect '[.]hidden'
+expect '?hidden'
+expect '*hidden'
+expect '*' 1 '\' ']' - '^' a b1 visible
+expect '.*' .hidden
+expect '\.hid*' .hidden
+
+exit $status
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Check that run-parts carries its USDT probes, as listed by readelf -n.
+# Exits 77, which automake counts as a skipped test, when run-parts was
+# built without <sys/sdt.h> or readelf is not installed.
+
+runparts=${RUN_PARTS:-./run-parts}
+
+if [ "$HAVE_SYS_SDT_H" != yes ]; then
+    echo "$0: run-parts built without <sys/sdt.h>" >&2
+    exit 77
+fi
+if ! command -v readelf >/dev/null 2>&1; then
+    echo "$0: readelf not found" >&2
+    exit 77
+fi
+
+probes=$(readelf -n "$runparts" |
+	 awk '$1 == "Provider:" { p = $2 } $1 == "Name:" && p == "run_parts" { print $2 }') ||
+    exit 1
+
+status=0
+for probe in scan__start scan__done filter part__start part__exit part__output; do
+    if ! printf '%s\n' "$probes" | grep -qx "$probe"; then
+	echo "$0: probe $probe missing from $runparts" >&2
+	status=1
+    fi
+done
+exit $status